@@ -19,6 +19,21 @@ case "${OS_TYPE}" in
         ;;
 esac
 
+# Endpoints of the socket, vhost-user and pcap cases
+NET_SOCK=/tmp/semu-ci-net.sock
+VHOST_SOCK=/tmp/semu-ci-vhost-user.sock
+PCAP_FILE=/tmp/semu-ci.pcapng
+LOOPBACK_PID=""
+
+stop_loopback() {
+    if [[ -n "${LOOPBACK_PID}" ]]; then
+        kill "${LOOPBACK_PID}" 2>/dev/null || true
+        LOOPBACK_PID=""
+    fi
+}
+
+trap 'cleanup; stop_loopback' EXIT INT TERM
+
 # Clean up any existing semu processes before starting tests
 cleanup
 
@@ -60,10 +75,20 @@ fi
 # Test network device functionality
 TEST_NETDEV() {
     local NETDEV=$1
+    local SPEC=${NETDEV}
+
+    case "${NETDEV}" in
+        vhost-user)
+            SPEC="vhost-user,path=${VHOST_SOCK}"
+            ;;
+        pcap)
+            SPEC="user,pcap=${PCAP_FILE}"
+            ;;
+    esac
 
     ASSERT expect <<DONE
     set timeout ${TIMEOUT}
-    spawn make check NETDEV=${NETDEV}
+    spawn make check NETDEV=${SPEC}
     expect "buildroot login:" { send "root\\n" } timeout { exit 1 }
     expect "# " { send "uname -a\\n" } timeout { exit 2 }
 
@@ -80,6 +105,22 @@ TEST_NETDEV() {
         expect "# " { send "ip route add default via 10.0.2.2\\n"}
         expect "# " { send "ping -c 3 10.0.2.2\\n" }
         expect "3 packets transmitted, 3 packets received, 0% packet loss" { } timeout { exit 4 }
+    } elseif { "$NETDEV" == "pcap" } {
+        # user mode with a capture; SIGTERM lets semu flush it on exit
+        expect "riscv32 GNU/Linux" { send "ip addr add 10.0.2.15/24 dev eth0\\n" } timeout { exit 3 }
+        expect "# " { send "ip link set eth0 up\\n"}
+        expect "# " { send "ip route add default via 10.0.2.2\\n"}
+        expect "# " { send "ping -c 3 10.0.2.2\\n" }
+        expect "3 packets transmitted, 3 packets received, 0% packet loss" { } timeout { exit 4 }
+        exec pkill -TERM -x semu
+        expect eof
+    } elseif { "$NETDEV" == "vhost-user" } {
+        # The loopback back-end hands every transmitted frame back
+        expect "riscv32 GNU/Linux" { send "ip addr add 192.168.200.1/24 dev eth0\\n" } timeout { exit 3 }
+        expect "# " { send "ip link set eth0 up\\n" }
+        expect "# " { send "ping -c 1 -W 2 192.168.200.2\\n" }
+        expect "# " { send "grep -q ^0 /sys/class/net/eth0/statistics/rx_packets || echo 'frames-'returned\\n" }
+        expect "frames-returned" { } timeout { exit 4 }
     } elseif { "$NETDEV" == "vmnet" } {
         # vmnet (macOS): detect host-provided gateway and configure statically
         set vmnet_info [exec \$env(SCRIPT_DIR)/detect-vmnet-network.sh]
@@ -98,6 +139,42 @@ TEST_NETDEV() {
 DONE
 }
 
+# Two guests on one socket segment ping each other. The first one hosts the
+# switch and stays up. Both boot from a snapshot of the same disk image.
+TEST_SOCKET() {
+    local SPEC="socket,path=${NET_SOCK}"
+
+    rm -f "${NET_SOCK}"
+    ASSERT expect <<DONE
+    set timeout ${TIMEOUT}
+    spawn make check NETDEV=${SPEC} DISKIMG_OPTS=,snapshot
+    set host \$spawn_id
+    expect -i \$host "buildroot login:" { send -i \$host "root\\n" } timeout { exit 1 }
+    expect -i \$host "# " { send -i \$host "ip addr add 192.168.100.1/24 dev eth0\\n" } timeout { exit 2 }
+    expect -i \$host "# " { send -i \$host "ip link set eth0 up\\n" }
+    expect -i \$host "# " { } timeout { exit 3 }
+
+    spawn make check NETDEV=${SPEC} DISKIMG_OPTS=,snapshot
+    set peer \$spawn_id
+    expect -i \$peer "buildroot login:" { send -i \$peer "root\\n" } timeout { exit 1 }
+    expect -i \$peer "# " { send -i \$peer "ip addr add 192.168.100.2/24 dev eth0\\n" } timeout { exit 2 }
+    expect -i \$peer "# " { send -i \$peer "ip link set eth0 up\\n" }
+    expect -i \$peer "# " { send -i \$peer "ping -c 3 192.168.100.1\\n" } timeout { exit 3 }
+    expect -i \$peer "3 packets transmitted, 3 packets received, 0% packet loss" { } timeout { exit 4 }
+DONE
+}
+
+# The capture left by the pcap case must be a pcapng file holding more than
+# its section and interface headers
+CHECK_PCAP() {
+    local MAGIC
+
+    [[ -f "${PCAP_FILE}" ]] || return 4
+    MAGIC=$(od -An -tx1 -N4 "${PCAP_FILE}" | tr -d ' ')
+    [[ "${MAGIC}" == "0a0d0d0a" ]] || return 4
+    [[ $(wc -c < "${PCAP_FILE}") -gt 512 ]] || return 4
+}
+
 # Determine network devices to test based on platform
 if [[ -n "${NETDEV}" ]]; then
     # NETDEV environment variable specified - test only that device
@@ -113,12 +190,13 @@ elif [[ ${IS_MACOS} -eq 1 ]]; then
         echo "Run with 'sudo' to test vmnet mode"
     fi
 else
-    # Linux: test tap (requires sudo) and user (no sudo)
+    # Linux: test tap (requires sudo), user, socket, vhost-user and a user
+    # mode packet capture (no sudo)
     if [[ $EUID -eq 0 ]]; then
-        NETWORK_DEVICES=(tap user)
+        NETWORK_DEVICES=(tap user socket vhost-user pcap)
     else
-        NETWORK_DEVICES=(user)
-        echo "Note: Running without sudo, testing user mode only"
+        NETWORK_DEVICES=(user socket vhost-user pcap)
+        echo "Note: Running without sudo, skipping tap mode"
         echo "Run with 'sudo' to test tap mode"
     fi
 fi
@@ -132,7 +210,30 @@ for NETDEV in "${NETWORK_DEVICES[@]}"; do
     echo "========================================="
     echo "Testing network device: $NETDEV"
     echo "========================================="
-    TEST_NETDEV $NETDEV
+    case "$NETDEV" in
+        socket)
+            TEST_SOCKET
+            ;;
+        vhost-user)
+            make scripts/vhost-user-loopback
+            scripts/vhost-user-loopback "${VHOST_SOCK}" &
+            LOOPBACK_PID=$!
+            for i in $(seq 50); do
+                [[ -S "${VHOST_SOCK}" ]] && break
+                sleep 0.1
+            done
+            TEST_NETDEV $NETDEV
+            stop_loopback
+            ;;
+        pcap)
+            rm -f "${PCAP_FILE}"
+            TEST_NETDEV $NETDEV
+            ASSERT CHECK_PCAP
+            ;;
+        *)
+            TEST_NETDEV $NETDEV
+            ;;
+    esac
     echo "✓ $NETDEV test passed"
 done
 
@@ -0,0 +1,91 @@
+#!/usr/bin/env bash
+
+# Boot from the disk image variants that virtio-blk serves without writing to
+# the image itself: a compressed image, a snapshot and a copy-on-write overlay.
+# The base image must come out of every case unchanged.
+
+# Source common functions and settings
+SCRIPT_DIR="$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)"
+export SCRIPT_DIR
+source "${SCRIPT_DIR}/common.sh"
+
+# Clean up any existing semu processes before starting tests
+cleanup
+
+# The cases need /dev/vda as the root filesystem
+make minimal.dtb ext4.img
+if ! grep -qa "root=/dev/vda" minimal.dtb; then
+    echo "Skipped: the disk image tests need ENABLE_EXTERNAL_ROOT=1"
+    exit 0
+fi
+
+WORK_DIR="$(mktemp -d "${TMPDIR:-/tmp}/semu-vblk.XXXXXX")"
+BASE="${WORK_DIR}/base.img"
+trap 'cleanup; rm -rf "${WORK_DIR}"' EXIT INT TERM
+
+# Start from a fresh root filesystem: one left dirty by an earlier boot needs
+# journal recovery, which a read-only device cannot provide
+ASSERT scripts/rootfs_ext4.sh rootfs.cpio "${BASE}"
+ASSERT python3 scripts/compress-disk.py "${BASE}" "${WORK_DIR}/base.cz"
+BASE_SUM="$(cksum < "${BASE}")"
+
+# Boot from DISK with the per-disk OPTS and run the commands of CASE
+TEST_VBLK() {
+    local CASE=$1
+    local DISK=$2
+    local OPTS=${3:-}
+
+    ASSERT expect <<DONE
+    set timeout ${TIMEOUT}
+    spawn make check DISKIMG_FILE=${DISK} DISKIMG_OPTS=${OPTS}
+    expect "buildroot login:" { send "root\\n" } timeout { exit 1 }
+    expect "# " { send "uname -a\\n" } timeout { exit 2 }
+
+    if { "$CASE" == "compressed" } {
+        # Every sector must read back as in the raw image
+        expect "riscv32 GNU/Linux" { send "cksum /dev/vda\\n" } timeout { exit 3 }
+        expect "${BASE_SUM} /dev/vda" { } timeout { exit 4 }
+    } elseif { "$CASE" == "snapshot" } {
+        expect "riscv32 GNU/Linux" { send "echo snapshot > /root/semu-ci && sync\\n" } timeout { exit 3 }
+        expect "# " { } timeout { exit 4 }
+    } elseif { "$CASE" == "overlay-write" } {
+        expect "riscv32 GNU/Linux" { send "echo over''lay > /root/semu-ci && sync\\n" } timeout { exit 3 }
+        expect "# " { } timeout { exit 4 }
+    } elseif { "$CASE" == "overlay-read" } {
+        # The write of the previous boot lives in the overlay
+        expect "riscv32 GNU/Linux" { send "cat /root/semu-ci\\n" } timeout { exit 3 }
+        expect "overlay" { } timeout { exit 4 }
+    }
+    send "\x01"; send "x"
+    expect eof
+DONE
+}
+
+echo "Testing compressed image"
+TEST_VBLK compressed "${WORK_DIR}/base.cz"
+echo "Testing snapshot"
+TEST_VBLK snapshot "${BASE}" ,snapshot
+echo "Testing overlay"
+TEST_VBLK overlay-write "${BASE}" ",overlay=${WORK_DIR}/overlay.img"
+TEST_VBLK overlay-read "${BASE}" ",overlay=${WORK_DIR}/overlay.img"
+
+ret=0
+if [ "$(cksum < "${BASE}")" != "${BASE_SUM}" ]; then
+    ret=5
+fi
+
+MESSAGES=("OK!" \
+     "Fail to boot" \
+     "Fail to login" \
+     "Fail to run commands" \
+     "Disk contents differ" \
+     "Base image was modified" \
+)
+
+if [ "$ret" -eq 0 ]; then
+    print_success "${MESSAGES["$ret"]}"
+else
+    print_error "${MESSAGES["$ret"]}"
+fi
+
+exit "$ret"
@@ -8,6 +8,7 @@ void aclint_mtimer_update_interrupts(hart_t *hart, mtimer_state_t *mtimer)
 {
     if (semu_timer_get(&mtimer->mtime) >= mtimer->mtimecmp[hart->mhartid]) {
         hart->sip |= RV_INT_STI_BIT; /* Set Supervisor Timer Interrupt */
+        hart->irq_check = true;
         /* Clear WFI flag when interrupt is injected - wakes the hart */
         hart->in_wfi = false;
     } else {
@@ -115,6 +116,7 @@ void aclint_mswi_update_interrupts(hart_t *hart, mswi_state_t *mswi)
 {
     if (mswi->msip[hart->mhartid]) {
         hart->sip |= RV_INT_SSI_BIT; /* Set Machine Software Interrupt */
+        hart->irq_check = true;
         /* Clear WFI flag when interrupt is injected */
         hart->in_wfi = false;
     } else {
@@ -181,6 +183,7 @@ void aclint_sswi_update_interrupts(hart_t *hart, sswi_state_t *sswi)
 {
     if (sswi->ssip[hart->mhartid]) {
         hart->sip |= RV_INT_SSI_BIT; /* Set Supervisor Software Interrupt */
+        hart->irq_check = true;
         /* Clear WFI flag when interrupt is injected */
         hart->in_wfi = false;
     } else {
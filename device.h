@@ -91,6 +91,7 @@ void capture_keyboard_input();
 #if SEMU_HAS(VIRTIONET)
 #define IRQ_VNET 2
 #define IRQ_VNET_BIT (1 << IRQ_VNET)
+#define VNET_PAIRS_MAX NETDEV_QUEUES_MAX
 
 typedef struct {
     uint32_t QueueNum;
@@ -100,23 +101,42 @@ typedef struct {
     uint16_t last_avail;
     bool ready;
     bool fd_ready;
+    /* used buffers whose interrupt is held back, and since when */
+    uint32_t coal_pending;
+    uint64_t coal_since;
 } virtio_net_queue_t;
 
+/* Interrupt coalescing: notify once 'max_packets' buffers were used, or
+ * 'usecs' of guest time after the first of them. Zero usecs notifies at once.
+ */
+typedef struct {
+    uint32_t max_packets;
+    uint32_t usecs;
+} virtio_net_coal_t;
+
 typedef struct {
     /* feature negotiation */
     uint32_t DeviceFeaturesSel;
     uint32_t DriverFeatures;
+    uint32_t DriverFeatures1; /* bits 32-63 */
     uint32_t DriverFeaturesSel;
     /* queue config */
     uint32_t QueueSel;
-    virtio_net_queue_t queues[2];
+    /* rx0, tx0, rx1, tx1, ..., then the control queue */
+    virtio_net_queue_t queues[VNET_PAIRS_MAX * 2 + 1];
+    uint32_t active_pairs;
+    virtio_net_coal_t rx_coal, tx_coal;
     /* status */
     uint32_t Status;
     uint32_t InterruptStatus;
     /* supplied by environment */
     netdev_t peer;
     uint32_t *ram;
+    uint32_t num_pairs;
+    semu_timer_t *guest_clock; /* timestamps frames, times coalescing */
+    virtio_net_coal_t rx_coal_default; /* host-side RX coalescing */
     /* implementation-specific */
+    net_pcap_t *pcap; /* NULL unless capturing */
     void *priv;
 } virtio_net_state_t;
 
@@ -132,24 +152,46 @@ void virtio_net_write(hart_t *core,
                       uint32_t value);
 void virtio_net_refresh_queue(virtio_net_state_t *vnet);
 
-void virtio_net_recv_from_peer(void *peer);
+/* Readable when the network backend has frames for the guest; -1 if the
+ * backend is polled from virtio_net_refresh_queue() alone.
+ */
+int virtio_net_wake_fd(const virtio_net_state_t *vnet);
+
+/* True while a coalesced interrupt is held back; the device then needs
+ * virtio_net_refresh_queue() calls to deliver it on time.
+ */
+bool virtio_net_coal_pending(const virtio_net_state_t *vnet);
 
-bool virtio_net_init(virtio_net_state_t *vnet, const char *name);
+bool virtio_net_init(virtio_net_state_t *vnet, char *spec, uint32_t num_pairs);
 #endif /* SEMU_HAS(VIRTIONET) */
 
 /* VirtIO-Block */
 
+/* Bound on the -d options accepted, also when virtio-blk is compiled out */
+#define VBLK_DEV_CNT_MAX 4
+
 #if SEMU_HAS(VIRTIOBLK)
 
 #define IRQ_VBLK 3
 #define IRQ_VBLK_BIT (1 << IRQ_VBLK)
 
+/* The first disk (vda) lives at 0xF4200000 on IRQ_VBLK. Further disks given
+ * with repeated -d options take the 1 MiB MMIO windows from 0xF4B00000 on and
+ * the interrupt lines from IRQ_VBLK_EXTRA on.
+ */
+#define VBLK_EXTRA_MMIO_REGION 0x4B
+#define IRQ_VBLK_EXTRA 9
+
+/* Upper bound on request queues (VIRTIO_BLK_F_MQ), one per hart */
+#define VBLK_QUEUE_MAX 32
+
 typedef struct {
     uint32_t QueueNum;
     uint32_t QueueDesc;
     uint32_t QueueAvail;
     uint32_t QueueUsed;
     uint16_t last_avail;
+    uint16_t last_signalled; /* used idx at the last interrupt decision */
     bool ready;
 } virtio_blk_queue_t;
 
@@ -160,7 +202,7 @@ typedef struct {
     uint32_t DriverFeaturesSel;
     /* queue config */
     uint32_t QueueSel;
-    virtio_blk_queue_t queues[2];
+    virtio_blk_queue_t queues[VBLK_QUEUE_MAX];
     /* status */
     uint32_t Status;
     uint32_t InterruptStatus;
@@ -183,7 +225,26 @@ void virtio_blk_write(hart_t *vm,
                       uint8_t width,
                       uint32_t value);
 
-uint32_t *virtio_blk_init(virtio_blk_state_t *vblk, char *disk_file);
+/* "disk_spec" is "FILE[,OPTION...]" as given to -d; "num_queues" request
+ * queues are exposed, normally one per hart.
+ */
+uint32_t *virtio_blk_init(virtio_blk_state_t *vblk,
+                          char *disk_spec,
+                          uint32_t num_queues);
+
+/* Publish requests completed by the asynchronous backend to the used ring */
+void virtio_blk_refresh_queue(virtio_blk_state_t *vblk);
+
+/* Descriptor that becomes readable when asynchronous requests complete, or -1
+ * when the device runs synchronously.
+ */
+int virtio_blk_wake_fd(const virtio_blk_state_t *vblk);
+
+/* Whether any disk was opened with the "stats" option */
+bool virtio_blk_stats_enabled(void);
+
+/* Print the I/O statistics of every disk opened with the "stats" option */
+void virtio_blk_print_stats(void);
 #endif /* SEMU_HAS(VIRTIOBLK) */
 
 /* VirtIO-RNG */
@@ -495,6 +556,28 @@ bool virtio_fs_init(virtio_fs_state_t *vfs, char *mtag, char *dir);
 
 #endif /* SEMU_HAS(VIRTIOFS) */
 
+/* SBI RFENCE shootdown queue
+ *
+ * Remote fences are queued on each target hart and applied by that hart
+ * before it executes its next instruction, instead of being performed on its
+ * MMU caches from the caller's context. Requests arriving within one slice
+ * are batched; when the queue overflows it degrades to a full flush.
+ */
+#define RFENCE_QUEUE_SIZE 8
+
+typedef struct {
+    uint32_t start_addr;
+    uint32_t size; /* 0 or UINT32_MAX flushes the whole address space */
+    uint32_t asid; /* recorded only; the MMU caches are not ASID-tagged */
+} rfence_req_t;
+
+typedef struct {
+    rfence_req_t req[RFENCE_QUEUE_SIZE];
+    uint32_t count;
+    bool flush_all;
+    bool fence_i;
+} rfence_queue_t;
+
 /* memory mapping */
 typedef struct {
     int exit_code;
@@ -509,7 +592,7 @@ typedef struct {
     virtio_net_state_t vnet;
 #endif
 #if SEMU_HAS(VIRTIOBLK)
-    virtio_blk_state_t vblk;
+    virtio_blk_state_t vblk[VBLK_DEV_CNT_MAX];
 #endif
 #if SEMU_HAS(VIRTIORNG)
     virtio_rng_state_t vrng;
@@ -518,6 +601,8 @@ typedef struct {
     mtimer_state_t mtimer;
     mswi_state_t mswi;
     sswi_state_t sswi;
+    /* Pending SBI RFENCE requests, one queue per hart */
+    rfence_queue_t *rfence;
 #if SEMU_HAS(VIRTIOSND)
     virtio_snd_state_t vsnd;
 #endif
@@ -7,6 +7,11 @@
 #define SEMU_FEATURE_VIRTIOBLK 1
 #endif
 
+/* compressed read-only virtio-blk images, needs zlib */
+#ifndef SEMU_FEATURE_VBLK_COMPRESS
+#define SEMU_FEATURE_VBLK_COMPRESS 0
+#endif
+
 /* virtio-net */
 #ifndef SEMU_FEATURE_VIRTIONET
 #define SEMU_FEATURE_VIRTIONET 1
@@ -43,8 +43,12 @@ static int semu_run_chunk(emu_state_t *emu, int steps);
 
 enum {
     SEMU_SMP_SLICE_STEPS = 8,
+    SEMU_SMP_BATCH_STEPS = 64,
     SEMU_SINGLE_SLICE_STEPS = 512,
-    SEMU_SLIRP_SLICE_STEPS = 8,
+    /* Upper bound on the number of doublings applied to the slice lengths
+     * above while a hart observes no device, timer or IPI activity.
+     */
+    SEMU_SLICE_MAX_SHIFT = 3,
 };
 
 /* Define fetch separately since it is simpler (fixed width, already checked
@@ -94,15 +98,52 @@ static void emu_update_vnet_interrupts(vm_t *vm)
 #endif
 
 #if SEMU_HAS(VIRTIOBLK)
+static inline uint32_t emu_vblk_irq_bit(int idx)
+{
+    return idx ? 1U << (IRQ_VBLK_EXTRA + idx - 1) : IRQ_VBLK_BIT;
+}
+
 static void emu_update_vblk_interrupts(vm_t *vm)
 {
     emu_state_t *data = PRIV(vm->hart[0]);
-    if (data->vblk.InterruptStatus)
-        data->plic.active |= IRQ_VBLK_BIT;
-    else
-        data->plic.active &= ~IRQ_VBLK_BIT;
+    for (int i = 0; i < VBLK_DEV_CNT_MAX; i++) {
+        if (data->vblk[i].InterruptStatus)
+            data->plic.active |= emu_vblk_irq_bit(i);
+        else
+            data->plic.active &= ~emu_vblk_irq_bit(i);
+    }
     plic_update_interrupts(vm, &data->plic);
 }
+
+/* Set from the SIGUSR1 handler; the statistics are printed from the emulator
+ * loop, as fprintf() is not async-signal-safe.
+ */
+static volatile sig_atomic_t vblk_stats_requested = 0;
+static void vblk_stats_signal_handler(int sig UNUSED)
+{
+    vblk_stats_requested = 1;
+}
+
+/* Publish asynchronous completions of every disk */
+static void emu_refresh_vblk(vm_t *vm)
+{
+    emu_state_t *data = PRIV(vm->hart[0]);
+    bool pending = false;
+    for (int i = 0; i < VBLK_DEV_CNT_MAX; i++) {
+        virtio_blk_refresh_queue(&data->vblk[i]);
+        pending |= data->vblk[i].InterruptStatus != 0;
+    }
+    if (pending)
+        emu_update_vblk_interrupts(vm);
+}
+
+/* Map an MMIO region (bits 27:20 of the address) to its disk */
+static inline virtio_blk_state_t *emu_vblk_of(emu_state_t *data,
+                                              uint32_t region)
+{
+    return &data->vblk[region == 0x42 ? 0
+                                      : region - VBLK_EXTRA_MMIO_REGION + 1];
+}
 #endif
 
 #if SEMU_HAS(VIRTIORNG)
@@ -145,6 +186,7 @@ static void emu_update_timer_interrupt(hart_t *hart)
 
     /* Sync global timer with local timer */
     hart->time = data->mtimer.mtime;
+    vm_time_refresh(hart);
     aclint_mtimer_update_interrupts(hart, &data->mtimer);
 }
 
@@ -155,6 +197,26 @@ static void emu_update_swi_interrupt(hart_t *hart)
     aclint_sswi_update_interrupts(hart, &data->sswi);
 }
 
+/* Adaptive slice sizing
+ *
+ * The slice lengths above are the low-latency baseline. At every slice
+ * boundary the hart either doubles its slice (up to SEMU_SLICE_MAX_SHIFT
+ * doublings) when nothing happened since the previous boundary, or drops
+ * straight back to the baseline when it touched MMIO or has a deliverable
+ * interrupt pending. Device, timer and IPI sources all end up in sip, so
+ * checking it after the interrupt updates covers fd readiness that the
+ * peripheral tick has turned into an interrupt as well.
+ */
+static inline void emu_update_slice(hart_t *hart)
+{
+    if (hart->slice_activity || (hart->sip & hart->sie)) {
+        hart->slice_activity = false;
+        hart->slice_shift = 0;
+    } else if (hart->slice_shift < SEMU_SLICE_MAX_SHIFT) {
+        hart->slice_shift++;
+    }
+}
+
 #if SEMU_HAS(VIRTIOSND)
 static void emu_update_vsnd_interrupts(vm_t *vm)
 {
@@ -217,8 +279,11 @@ static inline void emu_tick_peripherals(emu_state_t *emu)
 #endif
 
 #if SEMU_HAS(VIRTIOBLK)
-        if (emu->vblk.InterruptStatus)
-            emu_update_vblk_interrupts(vm);
+        emu_refresh_vblk(vm);
+        if (unlikely(vblk_stats_requested)) {
+            vblk_stats_requested = 0;
+            virtio_blk_print_stats();
+        }
 #endif
 
 #if SEMU_HAS(VIRTIORNG)
@@ -269,6 +334,7 @@ static void mem_load(hart_t *hart,
     }
 
     if ((addr >> 28) == 0xF) { /* MMIO at 0xF_______ */
+        hart->slice_activity = true;
         /* 256 regions of 1MiB */
         switch ((addr >> 20) & MASK(8)) {
         case 0x0:
@@ -285,8 +351,12 @@ static void mem_load(hart_t *hart,
             return;
 #endif
 #if SEMU_HAS(VIRTIOBLK)
-        case 0x42: /* virtio-blk */
-            virtio_blk_read(hart, &data->vblk, addr & 0xFFFFF, width, value);
+        case 0x42: /* virtio-blk (vda) */
+        case 0x4B: /* virtio-blk (vdb - vdd) */
+        case 0x4C:
+        case 0x4D:
+            virtio_blk_read(hart, emu_vblk_of(data, (addr >> 20) & MASK(8)),
+                            addr & 0xFFFFF, width, value);
             return;
 #endif
         case 0x43: /* mtimer */
@@ -346,6 +416,7 @@ static void mem_store(hart_t *hart,
     }
 
     if ((addr >> 28) == 0xF) { /* MMIO at 0xF_______ */
+        hart->slice_activity = true;
         /* 256 regions of 1MiB */
         switch ((addr >> 20) & MASK(8)) {
         case 0x0:
@@ -364,8 +435,12 @@ static void mem_store(hart_t *hart,
             return;
 #endif
 #if SEMU_HAS(VIRTIOBLK)
-        case 0x42: /* virtio-blk */
-            virtio_blk_write(hart, &data->vblk, addr & 0xFFFFF, width, value);
+        case 0x42: /* virtio-blk (vda) */
+        case 0x4B: /* virtio-blk (vdb - vdd) */
+        case 0x4C:
+        case 0x4D:
+            virtio_blk_write(hart, emu_vblk_of(data, (addr >> 20) & MASK(8)),
+                             addr & 0xFFFFF, width, value);
             emu_update_vblk_interrupts(hart->vm);
             return;
 #endif
@@ -505,6 +580,35 @@ static inline sbi_ret_t handle_sbi_ecall_HSM(hart_t *hart, int32_t fid)
     return (sbi_ret_t) {SBI_ERR_FAILED, 0};
 }
 
+/* Deliver a supervisor software interrupt to "target" right away instead of
+ * leaving it latched in SSWI until the target's next slice boundary: raise
+ * SSIP in sip, clear in_wfi so the scheduler stops counting the hart as idle,
+ * and resume a hart parked by SBI_HSM__HART_SUSPEND. An IPI to a hart that
+ * already has one pending is coalesced into it.
+ */
+static void emu_send_ipi(emu_state_t *data, hart_t *target)
+{
+    if (!data->sswi.ssip[target->mhartid]) {
+        data->sswi.ssip[target->mhartid] = 1;
+        aclint_sswi_update_interrupts(target, &data->sswi);
+        target->slice_activity = true;
+    }
+
+    if (target->hsm_status == SBI_HSM_STATE_SUSPENDED) {
+        target->hsm_status = SBI_HSM_STATE_STARTED;
+        if (!target->hsm_resume_is_ret) {
+            /* Non-retentive suspend resumes like HART_START */
+            target->satp = 0;
+            target->sstatus_sie = false;
+            target->s_mode = true;
+            target->x_regs[RV_R_A0] = target->mhartid;
+            target->x_regs[RV_R_A1] = target->hsm_resume_opaque;
+            target->pc = target->hsm_resume_pc;
+            mmu_invalidate(target);
+        }
+    }
+}
+
 static inline sbi_ret_t handle_sbi_ecall_IPI(hart_t *hart, int32_t fid)
 {
     emu_state_t *data = PRIV(hart);
@@ -515,15 +619,17 @@ static inline sbi_ret_t handle_sbi_ecall_IPI(hart_t *hart, int32_t fid)
         hart_mask_base = (uint32_t) hart->x_regs[RV_R_A1];
         if (hart_mask_base == UINT32_MAX) {
             for (uint32_t i = 0; i < hart->vm->n_hart; i++)
-                data->sswi.ssip[i] = 1;
+                emu_send_ipi(data, hart->vm->hart[i]);
         } else {
             for (uint32_t i = hart_mask_base; hart_mask && i < hart->vm->n_hart;
                  hart_mask >>= 1, i++) {
                 if (hart_mask & 1)
-                    data->sswi.ssip[i] = 1;
+                    emu_send_ipi(data, hart->vm->hart[i]);
             }
         }
 
+        /* Shrink the sender's slice so the targets get scheduled soon */
+        hart->slice_activity = true;
         return (sbi_ret_t) {SBI_SUCCESS, 0};
         break;
     default:
@@ -531,43 +637,88 @@ static inline sbi_ret_t handle_sbi_ecall_IPI(hart_t *hart, int32_t fid)
     }
 }
 
+/* Apply the RFENCE requests queued for "hart". Called before the hart
+ * executes any further instruction: at the start of every chunk and when it
+ * resumes from WFI. A target can therefore never run with a stale
+ * translation, which is the acknowledgement SBI requires before the caller's
+ * ecall returns; with cooperatively scheduled harts no explicit wait is
+ * needed.
+ */
+static void emu_drain_rfence(hart_t *hart)
+{
+    emu_state_t *data = PRIV(hart);
+    rfence_queue_t *q = &data->rfence[hart->mhartid];
+
+    if (likely(!q->count && !q->flush_all && !q->fence_i))
+        return;
+
+    if (q->fence_i)
+        vm_fence_i(hart);
+    if (q->flush_all) {
+        mmu_invalidate(hart);
+    } else {
+        for (uint32_t i = 0; i < q->count; i++)
+            mmu_invalidate_range(hart, q->req[i].start_addr, q->req[i].size);
+    }
+    q->count = 0;
+    q->flush_all = false;
+    q->fence_i = false;
+}
+
+/* Queue a fence on "target"; the caller's own hart is fenced immediately */
+static void emu_queue_rfence(hart_t *caller,
+                             hart_t *target,
+                             bool fence_i,
+                             uint32_t start_addr,
+                             uint32_t size,
+                             uint32_t asid)
+{
+    emu_state_t *data = PRIV(caller);
+    rfence_queue_t *q = &data->rfence[target->mhartid];
+
+    if (fence_i) {
+        q->fence_i = true;
+    } else if (size == 0 || size == UINT32_MAX ||
+               q->count == RFENCE_QUEUE_SIZE) {
+        q->flush_all = true;
+    } else if (!q->flush_all) {
+        q->req[q->count++] = (rfence_req_t) {start_addr, size, asid};
+    }
+
+    if (target == caller)
+        emu_drain_rfence(target);
+}
+
 static inline sbi_ret_t handle_sbi_ecall_RFENCE(hart_t *hart, int32_t fid)
 {
     uint64_t hart_mask, hart_mask_base;
-    uint32_t start_addr, size;
+    uint32_t start_addr = 0, size = 0, asid = 0;
+    bool fence_i;
     switch (fid) {
-    case SBI_RFENCE__I:
-        hart_mask = (uint64_t) hart->x_regs[RV_R_A0];
-        hart_mask_base = (uint32_t) hart->x_regs[RV_R_A1];
-
-        if (hart_mask_base == UINT32_MAX) {
-            for (uint32_t i = 0; i < hart->vm->n_hart; i++)
-                vm_fence_i(hart->vm->hart[i]);
-        } else {
-            for (uint32_t i = hart_mask_base; hart_mask && i < hart->vm->n_hart;
-                 hart_mask >>= 1, i++) {
-                if (hart_mask & 1)
-                    vm_fence_i(hart->vm->hart[i]);
-            }
-        }
-        return (sbi_ret_t) {SBI_SUCCESS, 0};
-    case SBI_RFENCE__VMA:
     case SBI_RFENCE__VMA_ASID:
-        hart_mask = (uint64_t) hart->x_regs[RV_R_A0];
-        hart_mask_base = (uint32_t) hart->x_regs[RV_R_A1];
+        asid = hart->x_regs[RV_R_A4];
+        /* fallthrough */
+    case SBI_RFENCE__VMA:
         start_addr = hart->x_regs[RV_R_A2];
         size = hart->x_regs[RV_R_A3];
+        /* fallthrough */
+    case SBI_RFENCE__I:
+        fence_i = fid == SBI_RFENCE__I;
+        hart_mask = (uint64_t) hart->x_regs[RV_R_A0];
+        hart_mask_base = (uint32_t) hart->x_regs[RV_R_A1];
 
         if (hart_mask_base == UINT32_MAX) {
-            /* Flush all harts */
+            /* Fence all harts */
             for (uint32_t i = 0; i < hart->vm->n_hart; i++)
-                mmu_invalidate_range(hart->vm->hart[i], start_addr, size);
+                emu_queue_rfence(hart, hart->vm->hart[i], fence_i, start_addr,
+                                 size, asid);
         } else {
-            /* Flush specified harts based on mask */
+            /* Fence specified harts based on mask */
             for (uint32_t i = hart_mask_base; hart_mask && i < hart->vm->n_hart;
                  hart_mask >>= 1, i++) {
                 if (hart_mask & 1)
-                    mmu_invalidate_range(hart->vm->hart[i], start_addr, size);
+                    emu_queue_rfence(hart, hart->vm->hart[i], fence_i,
+                                     start_addr, size, asid);
             }
         }
         return (sbi_ret_t) {SBI_SUCCESS, 0};
@@ -666,7 +817,25 @@ static void unmap_files(void)
     }
 }
 
-static void map_file(char **ram_loc, const char *name)
+/* Copy a file into RAM, for when a private file mapping would hide the
+ * guest's writes from other processes sharing RAM.
+ */
+static void read_file(char **ram_loc, int fd, const char *name, size_t size)
+{
+    for (size_t off = 0; off < size;) {
+        ssize_t n = read(fd, *ram_loc + off, size - off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            fprintf(stderr, "could not read %s\n", name);
+            exit(2);
+        }
+        off += n;
+    }
+    *ram_loc += size;
+}
+
+static void map_file(char **ram_loc, const char *name, bool shared_ram)
 {
     int fd = open(name, O_RDONLY);
     if (fd < 0) {
@@ -678,6 +847,12 @@ static void map_file(char **ram_loc, const char *name)
     struct stat st;
     fstat(fd, &st);
 
+    if (shared_ram) {
+        read_file(ram_loc, fd, name, st.st_size);
+        close(fd);
+        return;
+    }
+
     /* remap to a memory region */
     *ram_loc = mmap(*ram_loc, st.st_size, PROT_READ | PROT_WRITE,
                     MAP_FIXED | MAP_PRIVATE, fd, 0);
@@ -703,7 +878,7 @@ static void usage(const char *execpath)
 {
     fprintf(stderr,
             "Usage: %s -k linux-image [-b dtb] [-i initrd-image] [-d "
-            "disk-image] [-s shared-directory] [-H]\n",
+            "disk-image]... [-s shared-directory] [-H]\n",
             execpath);
 }
 
@@ -712,15 +887,16 @@ static void handle_options(int argc,
                            char **kernel_file,
                            char **dtb_file,
                            char **initrd_file,
-                           char **disk_file,
+                           char **disk_files,
+                           int *n_disks,
                            char **net_dev,
                            int *hart_count,
                            bool *debug,
                            bool *headless,
                            char **shared_dir)
 {
-    *kernel_file = *dtb_file = *initrd_file = *disk_file = *net_dev =
-        *shared_dir = NULL;
+    *kernel_file = *dtb_file = *initrd_file = *net_dev = *shared_dir = NULL;
+    *n_disks = 0;
 
     int optidx = 0;
     struct option opts[] = {
@@ -744,7 +920,13 @@ static void handle_options(int argc,
             *initrd_file = optarg;
             break;
         case 'd':
-            *disk_file = optarg;
+            /* Each -d adds a disk: vda, vdb, ... */
+            if (*n_disks == VBLK_DEV_CNT_MAX) {
+                fprintf(stderr, "%s: at most %d disks can be given with -d\n",
+                        argv[0], VBLK_DEV_CNT_MAX);
+                exit(2);
+            }
+            disk_files[(*n_disks)++] = optarg;
             break;
         case 'n':
             *net_dev = optarg;
@@ -835,7 +1017,8 @@ static int semu_init(emu_state_t *emu, int argc, char **argv)
     char *kernel_file;
     char *dtb_file;
     char *initrd_file;
-    char *disk_file;
+    char *disk_files[VBLK_DEV_CNT_MAX];
+    int n_disks;
     char *netdev;
     char *shared_dir;
     int hart_count = 1;
@@ -846,8 +1029,8 @@ static int semu_init(emu_state_t *emu, int argc, char **argv)
 #endif
     vm_t *vm = &emu->vm;
     handle_options(argc, argv, &kernel_file, &dtb_file, &initrd_file,
-                   &disk_file, &netdev, &hart_count, &debug, &headless,
-                   &shared_dir);
+                   disk_files, &n_disks, &netdev, &hart_count, &debug,
+                   &headless, &shared_dir);
 #if !SEMU_HAS(VIRTIOINPUT)
     (void) headless;
 #endif
@@ -861,7 +1044,7 @@ static int semu_init(emu_state_t *emu, int argc, char **argv)
         return 2;
     }
 
-    if (!disk_file && uses_default_minimal_dtb(dtb_file)) {
+    if (!n_disks && uses_default_minimal_dtb(dtb_file)) {
         fprintf(stderr,
                 "warning: EXTERNAL_ROOT build expects -d <disk-image>; "
                 "without it the kernel will hang in rootwait.\n");
@@ -871,9 +1054,19 @@ static int semu_init(emu_state_t *emu, int argc, char **argv)
     /* Initialize the emulator */
     memset(emu, 0, sizeof(*emu));
 
-    /* Set up RAM */
-    emu->ram = mmap(NULL, RAM_SIZE, PROT_READ | PROT_WRITE,
-                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    /* Set up RAM. A vhost-user network back-end maps it as well, so it then
+     * has to be shared memory.
+     */
+    bool shared_ram = false;
+#if SEMU_HAS(VIRTIONET) && !defined(__APPLE__)
+    shared_ram = netdev && !strncmp(netdev, "vhost-user", 10) &&
+                 (netdev[10] == ',' || !netdev[10]);
+    if (shared_ram)
+        emu->ram = net_vhost_user_alloc_ram(RAM_SIZE);
+    else
+#endif
+        emu->ram = mmap(NULL, RAM_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
     if (emu->ram == MAP_FAILED) {
         fprintf(stderr, "Could not map RAM\n");
         return 2;
@@ -902,18 +1095,18 @@ static int semu_init(emu_state_t *emu, int argc, char **argv)
      */
     char *ram_loc = (char *) emu->ram;
     /* Load Linux kernel image at the base of RAM */
-    map_file(&ram_loc, kernel_file);
+    map_file(&ram_loc, kernel_file, shared_ram);
     /* Load dtb at the last 1 MiB so the kernel will not overwrite it */
     uint32_t dtb_addr = RAM_SIZE - DTB_SIZE;
     ram_loc = ((char *) emu->ram) + dtb_addr;
-    map_file(&ram_loc, dtb_file);
+    map_file(&ram_loc, dtb_file, shared_ram);
     /* Load optional initrd image in the 8 MiB just below the dtb region
      * (legacy boot path; not used when the guest boots from /dev/vda).
      */
     if (initrd_file) {
         uint32_t initrd_addr = dtb_addr - INITRD_SIZE;
         ram_loc = ((char *) emu->ram) + initrd_addr;
-        map_file(&ram_loc, initrd_file);
+        map_file(&ram_loc, initrd_file, shared_ram);
     }
 
     /* Hook for unmapping files */
@@ -957,8 +1150,9 @@ static int semu_init(emu_state_t *emu, int argc, char **argv)
      * Device tree may still expose the device to guest.
      */
     emu->vnet.ram = emu->ram;
+    emu->vnet.guest_clock = &emu->mtimer.mtime;
     if (netdev) {
-        if (!virtio_net_init(&emu->vnet, netdev)) {
+        if (!virtio_net_init(&emu->vnet, netdev, hart_count)) {
             fprintf(stderr, "Failed to initialize virtio-net device.\n");
             return 1;
         }
@@ -966,8 +1160,15 @@ static int semu_init(emu_state_t *emu, int argc, char **argv)
     }
 #endif
 #if SEMU_HAS(VIRTIOBLK)
-    emu->vblk.ram = emu->ram;
-    emu->disk = virtio_blk_init(&(emu->vblk), disk_file);
+    /* vda always exists, with zero capacity if no -d is given. Unused disk
+     * slots read as placeholder virtio-mmio devices.
+     */
+    for (int i = 0; i < VBLK_DEV_CNT_MAX; i++)
+        emu->vblk[i].ram = emu->ram;
+    emu->disk = virtio_blk_init(&emu->vblk[0], n_disks ? disk_files[0] : NULL,
+                                vm->n_hart);
+    for (int i = 1; i < n_disks; i++)
+        virtio_blk_init(&emu->vblk[i], disk_files[i], vm->n_hart);
 #endif
 #if SEMU_HAS(VIRTIORNG)
     emu->vrng.ram = emu->ram;
@@ -981,6 +1182,7 @@ static int semu_init(emu_state_t *emu, int argc, char **argv)
     emu->mswi.n_hart = vm->n_hart;
     emu->sswi.ssip = calloc(vm->n_hart, sizeof(uint32_t));
     emu->sswi.n_hart = vm->n_hart;
+    emu->rfence = calloc(vm->n_hart, sizeof(rfence_queue_t));
 #if SEMU_HAS(VIRTIOSND)
     if (!virtio_snd_init(&(emu->vsnd)))
         fprintf(stderr, "No virtio-snd functioned\n");
@@ -1078,6 +1280,7 @@ static void wfi_handler(hart_t *hart)
         if (vm->n_hart > 1) {
             hart->in_wfi = true; /* Mark as waiting for interrupt */
             coro_yield();        /* Suspend until scheduler resumes us */
+            emu_drain_rfence(hart);
             /* NOTE: Do NOT clear in_wfi here to avoid race condition.
              * The scheduler needs to see this flag to detect idle state.
              * The flag will be cleared when an interrupt is actually injected.
@@ -1095,8 +1298,9 @@ static void wfi_handler(hart_t *hart)
  * the scheduler to allow other harts and I/O coroutines to make progress.
  *
  * Execution model:
- * - Harts execute in batches of 64 instructions before yielding
- * - Peripheral polling and interrupt checks happen before each batch
+ * - Harts execute in batches of 64 instructions before yielding; quiet harts
+ *   grow the batch and its chunks adaptively (see emu_update_slice())
+ * - Peripheral polling and interrupt checks happen before each chunk
  * - WFI instruction triggers immediate yield (via wfi_handler callback)
  * - Harts in HSM_STATE_STOPPED remain suspended until IPI wakes them
  *
@@ -1125,17 +1329,23 @@ static void hart_exec_loop(void *arg)
         }
 
         /* Execute a batch of instructions before yielding.
-         * Keep peripheral polling at the original slice cadence so I/O and
-         * external interrupt latency do not scale with the batch size.
+         * Keep peripheral polling at the slice cadence so I/O and external
+         * interrupt latency do not scale with the batch size. The batch bound
+         * is re-evaluated per chunk, so activity observed mid-batch shrinks
+         * the remaining batch back to the baseline immediately.
          */
-        for (int i = 0; i < 64; i += SEMU_SMP_SLICE_STEPS) {
+        for (int i = 0; i < (SEMU_SMP_BATCH_STEPS << hart->slice_shift);) {
             emu_tick_peripherals(emu);
             emu_update_timer_interrupt(hart);
             emu_update_swi_interrupt(hart);
-            if (unlikely(semu_step_chunk(emu, hart, SEMU_SMP_SLICE_STEPS))) {
+            emu_update_slice(hart);
+
+            int steps = SEMU_SMP_SLICE_STEPS << hart->slice_shift;
+            if (unlikely(semu_step_chunk(emu, hart, steps))) {
                 emu->stopped = true;
                 goto cleanup;
             }
+            i += steps;
         }
 
         /* Yield to scheduler after executing batch */
@@ -1168,6 +1378,9 @@ static int semu_service_hart_step(emu_state_t *emu, hart_t *hart)
     return semu_step_chunk(emu, hart, 1);
 }
 
+/* Run one single-hart slice. "steps" is the baseline slice length; the
+ * instructions actually executed are "steps << hart->slice_shift".
+ */
 static int semu_run_chunk(emu_state_t *emu, int steps)
 {
     hart_t *hart = emu->vm.hart[0];
@@ -1175,11 +1388,13 @@ static int semu_run_chunk(emu_state_t *emu, int steps)
     emu_tick_peripherals(emu);
     emu_update_timer_interrupt(hart);
     emu_update_swi_interrupt(hart);
-    return semu_step_chunk(emu, hart, steps);
+    emu_update_slice(hart);
+    return semu_step_chunk(emu, hart, steps << hart->slice_shift);
 }
 
 static int semu_step_chunk(emu_state_t *emu, hart_t *hart, int steps)
 {
+    emu_drain_rfence(hart);
     while (steps > 0) {
         int executed = vm_step_many(hart, steps);
         steps -= executed;
@@ -1411,6 +1626,19 @@ static void semu_run(emu_state_t *emu)
             if (emu->wake_fd[0] >= 0)
                 needed++;
 #endif
+#if SEMU_HAS(VIRTIOBLK)
+            int vblk_wake_fd[VBLK_DEV_CNT_MAX];
+            for (int i = 0; i < VBLK_DEV_CNT_MAX; i++) {
+                vblk_wake_fd[i] = virtio_blk_wake_fd(&emu->vblk[i]);
+                if (vblk_wake_fd[i] >= 0)
+                    needed++;
+            }
+#endif
+#if SEMU_HAS(VIRTIONET)
+            int vnet_wake_fd = virtio_net_wake_fd(&emu->vnet);
+            if (vnet_wake_fd >= 0)
+                needed++;
+#endif
 
             /* Grow buffer if needed (amortized realloc) */
             if (needed > poll_capacity) {
@@ -1529,6 +1757,34 @@ static void semu_run(emu_state_t *emu)
             }
 #endif
 
+#if SEMU_HAS(VIRTIOBLK)
+            /* Completions of asynchronous virtio-blk requests must wake an
+             * idle loop, since the guest is typically waiting for them.
+             */
+            int vblk_pfd_index[VBLK_DEV_CNT_MAX];
+            for (int i = 0; i < VBLK_DEV_CNT_MAX; i++) {
+                vblk_pfd_index[i] = -1;
+                if (vblk_wake_fd[i] >= 0 && pfd_count < poll_capacity) {
+                    pfds[pfd_count] =
+                        (struct pollfd) {vblk_wake_fd[i], POLLIN, 0};
+                    vblk_pfd_index[i] = (int) pfd_count;
+                    pfd_count++;
+                }
+            }
+#endif
+
+#if SEMU_HAS(VIRTIONET)
+            /* Frames queued by the slirp thread must likewise wake an idle
+             * loop, or they would wait for the next timer tick.
+             */
+            int vnet_pfd_index = -1;
+            if (vnet_wake_fd >= 0 && pfd_count < poll_capacity) {
+                pfds[pfd_count] = (struct pollfd) {vnet_wake_fd, POLLIN, 0};
+                vnet_pfd_index = (int) pfd_count;
+                pfd_count++;
+            }
+#endif
+
             /* Set poll timeout based on current idle state (adaptive timeout).
              * Three-tier strategy:
              * 1. Blocking (-1): All harts idle + have fds → wait for events
@@ -1550,6 +1806,14 @@ static void semu_run(emu_state_t *emu)
                 /* All harts active: non-blocking */
                 poll_timeout = 0;
             }
+#if SEMU_HAS(VIRTIONET)
+            /* Coalesced interrupts are held back for microseconds; do not
+             * sleep past them.
+             */
+            bool vnet_coal = virtio_net_coal_pending(&emu->vnet);
+            if (vnet_coal && poll_timeout != 0)
+                poll_timeout = 1;
+#endif
 
             /* Execute poll() to wait for I/O events.
              * - timeout=0: non-blocking poll when harts are active
@@ -1601,6 +1865,25 @@ static void semu_run(emu_state_t *emu)
             }
 #endif
 
+#if SEMU_HAS(VIRTIOBLK)
+            for (int i = 0; i < VBLK_DEV_CNT_MAX; i++) {
+                if (vblk_pfd_index[i] >= 0 &&
+                    (pfds[vblk_pfd_index[i]].revents & POLLIN)) {
+                    emu_refresh_vblk(vm);
+                    break;
+                }
+            }
+#endif
+
+#if SEMU_HAS(VIRTIONET)
+            if (vnet_coal || (vnet_pfd_index >= 0 &&
+                              (pfds[vnet_pfd_index].revents & POLLIN))) {
+                virtio_net_refresh_queue(&emu->vnet);
+                if (emu->vnet.InterruptStatus)
+                    emu_update_vnet_interrupts(vm);
+            }
+#endif
+
             /* Resume all hart coroutines (round-robin scheduling).
              * Each hart executes a batch of instructions, then yields back.
              * Harts in WFI will have their in_wfi flag cleared by interrupt
@@ -1659,44 +1942,10 @@ static void semu_run(emu_state_t *emu)
         /* Break out on SIGINT/SIGTERM so atexit hooks fire on graceful exit. */
         if (signal_received)
             break;
-#if SEMU_HAS(VIRTIONET)
-        int i = 0;
-        if (emu->vnet.peer.type == NETDEV_IMPL_user && boot_complete) {
-            net_user_options_t *usr = (net_user_options_t *) emu->vnet.peer.op;
-
-            uint32_t timeout = -1;
-            usr->pfd_len = 1;
-            slirp_pollfds_fill_socket(usr->slirp, &timeout,
-                                      semu_slirp_add_poll_socket, usr);
-
-            /* Poll the internal pipe for incoming data. If data is
-             * available (POLL_IN), process it and forward it to the
-             * virtio-net device.
-             */
-            int pollout = poll(usr->pfd, usr->pfd_len, 1);
-            if (usr->pfd[0].revents & POLLIN) {
-                virtio_net_recv_from_peer(usr->peer);
-            }
-            slirp_pollfds_poll(usr->slirp, (pollout <= 0),
-                               semu_slirp_get_revents, usr);
-            for (i = 0; i < SLIRP_POLL_INTERVAL; i += SEMU_SLIRP_SLICE_STEPS) {
-                int steps =
-                    MIN(SEMU_SLIRP_SLICE_STEPS, SLIRP_POLL_INTERVAL - i);
-
-                ret = semu_run_chunk(emu, steps);
-                if (ret) {
-                    emu->exit_code = ret;
-                    return;
-                }
-            }
-        } else
-#endif
-        {
-            ret = semu_run_chunk(emu, SEMU_SINGLE_SLICE_STEPS);
-            if (ret) {
-                emu->exit_code = ret;
-                return;
-            }
+        ret = semu_run_chunk(emu, SEMU_SINGLE_SLICE_STEPS);
+        if (ret) {
+            emu->exit_code = ret;
+            return;
         }
     }
 
@@ -1883,6 +2132,15 @@ int main(int argc, char **argv)
         sa.sa_flags = 0;
         sigaction(SIGINT, &sa, NULL);
         sigaction(SIGTERM, &sa, NULL);
+#if SEMU_HAS(VIRTIOBLK)
+        /* kill -USR1 prints the "-d FILE,stats" disk statistics. Without
+         * such a disk, SIGUSR1 keeps its default action.
+         */
+        if (virtio_blk_stats_enabled()) {
+            sa.sa_handler = vblk_stats_signal_handler;
+            sigaction(SIGUSR1, &sa, NULL);
+        }
+#endif
     }
 
 #if SEMU_HAS(VIRTIOINPUT)
@@ -45,6 +45,12 @@ int main(){\n\
 }\n'
 endef
 
+# Check zlib installation
+define check-zlib
+$(shell echo '#include <zlib.h>\nint main(){ return zlibVersion() == 0; }' \
+	| $(CC) -x c - -lz -o /dev/null > /dev/null 2> /dev/null && echo 0 || echo 1)
+endef
+
 # Check ALSA installation
 define check-alsa
 $(shell $(call create-alsa-prog) | $(CC) -x c - -lasound -o /dev/null > /dev/null 2> /dev/null 
@@ -0,0 +1,283 @@
+/*
+ * Packet capture for virtio-net in pcapng format
+ *
+ * Every frame the device moves is appended, already formatted as an
+ * Enhanced Packet Block, to a single-producer single-consumer byte ring. The
+ * emulator thread is the only producer and never waits for file I/O; a
+ * background thread drains the ring into the file. Frames that do not
+ * fit in the ring, or that would push the file past its size limit, are
+ * dropped and counted, and the counts are written in an Interface Statistics
+ * Block when the capture is closed at exit.
+ *
+ * Each packet carries the host wall-clock time as its timestamp and the guest
+ * clock in a comment, so that captures can be lined up with host-side traces
+ * as well as with the guest's own view of time.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "netdev.h"
+
+#define PCAPNG_SHB 0x0A0D0D0A
+#define PCAPNG_IDB 0x00000001
+#define PCAPNG_ISB 0x00000005
+#define PCAPNG_EPB 0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1A2B3C4D
+#define PCAPNG_LINKTYPE_ETHERNET 1
+
+#define PCAPNG_OPT_END 0
+#define PCAPNG_OPT_COMMENT 1
+#define PCAPNG_EPB_FLAGS 2
+#define PCAPNG_ISB_IFRECV 4
+#define PCAPNG_ISB_IFDROP 5
+
+#define PCAPNG_FLAG_INBOUND 1
+#define PCAPNG_FLAG_OUTBOUND 2
+
+#define PCAP_PAD4(n) (((n) + 3) & ~(size_t) 3)
+
+/* The drain thread sleeps this long whenever it finds the ring empty */
+#define PCAP_DRAIN_INTERVAL_NS 10000000
+
+/* Captures still open, closed by an atexit hook */
+static net_pcap_t *pcap_open_list;
+
+static uint64_t pcap_host_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void pcap_put32(uint8_t *p, uint32_t v)
+{
+    memcpy(p, &v, 4);
+}
+
+static void pcap_put16(uint8_t *p, uint16_t v)
+{
+    memcpy(p, &v, 2);
+}
+
+/* Copy 'n' bytes into the ring at the producer position 'pos' */
+static void pcap_ring_put(net_pcap_t *pcap,
+                          uint64_t pos,
+                          const void *src,
+                          size_t n)
+{
+    size_t off = pos & (pcap->size - 1), first = MIN(n, pcap->size - off);
+    memcpy(pcap->ring + off, src, first);
+    memcpy(pcap->ring, (const uint8_t *) src + first, n - first);
+}
+
+void net_pcap_capture(net_pcap_t *pcap,
+                      const struct iovec *iov,
+                      size_t niov,
+                      size_t skip,
+                      size_t len,
+                      bool tx,
+                      uint64_t guest_ns)
+{
+    char comment[48];
+    int clen = snprintf(comment, sizeof(comment), "guest clock %llu.%09llu",
+                        (unsigned long long) (guest_ns / 1000000000),
+                        (unsigned long long) (guest_ns % 1000000000));
+
+    /* EPB: 28-byte header, padded data, flags and comment options, end of
+     * options and the trailing length.
+     */
+    size_t blen = 28 + PCAP_PAD4(len) + 8 + 4 + PCAP_PAD4(clen) + 4 + 4;
+    uint64_t head = pcap->head;
+    if (head - __atomic_load_n(&pcap->tail, __ATOMIC_ACQUIRE) + blen >
+            pcap->size ||
+        (pcap->limit && head + blen > pcap->limit)) {
+        pcap->dropped++;
+        return;
+    }
+
+    uint64_t ts = pcap_host_ns() / 1000;
+    uint8_t hdr[28];
+    pcap_put32(hdr, PCAPNG_EPB);
+    pcap_put32(hdr + 4, blen);
+    pcap_put32(hdr + 8, 0); /* interface */
+    pcap_put32(hdr + 12, ts >> 32);
+    pcap_put32(hdr + 16, ts);
+    pcap_put32(hdr + 20, len);
+    pcap_put32(hdr + 24, len);
+    pcap_ring_put(pcap, head, hdr, sizeof(hdr));
+    uint64_t pos = head + sizeof(hdr);
+
+    /* Frame data, gathered without consuming the caller's iovec */
+    for (size_t i = 0, left = len; i < niov && left; i++) {
+        size_t n = iov[i].iov_len;
+        if (skip >= n) {
+            skip -= n;
+            continue;
+        }
+        n = MIN(n - skip, left);
+        pcap_ring_put(pcap, pos, (const uint8_t *) iov[i].iov_base + skip, n);
+        pos += n, left -= n, skip = 0;
+    }
+    static const uint8_t zero[4];
+    pcap_ring_put(pcap, pos, zero, PCAP_PAD4(len) - len);
+    pos += PCAP_PAD4(len) - len;
+
+    uint8_t opt[8];
+    pcap_put16(opt, PCAPNG_EPB_FLAGS);
+    pcap_put16(opt + 2, 4);
+    pcap_put32(opt + 4, tx ? PCAPNG_FLAG_OUTBOUND : PCAPNG_FLAG_INBOUND);
+    pcap_ring_put(pcap, pos, opt, 8);
+    pos += 8;
+    pcap_put16(opt, PCAPNG_OPT_COMMENT);
+    pcap_put16(opt + 2, clen);
+    pcap_ring_put(pcap, pos, opt, 4);
+    pcap_ring_put(pcap, pos + 4, comment, clen);
+    pcap_ring_put(pcap, pos + 4 + clen, zero, PCAP_PAD4(clen) - clen);
+    pos += 4 + PCAP_PAD4(clen);
+    pcap_put32(opt, PCAPNG_OPT_END);
+    pcap_put32(opt + 4, blen);
+    pcap_ring_put(pcap, pos, opt, 8);
+
+    pcap->captured++;
+    __atomic_store_n(&pcap->head, head + blen, __ATOMIC_RELEASE);
+}
+
+static void *pcap_drain_thread(void *arg)
+{
+    net_pcap_t *pcap = arg;
+    uint64_t tail = pcap->tail;
+
+    for (;;) {
+        /* Look at the stop flag first so that the last blocks queued before
+         * it was raised are still written.
+         */
+        bool stop = __atomic_load_n(&pcap->stop, __ATOMIC_ACQUIRE);
+        uint64_t head = __atomic_load_n(&pcap->head, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            if (stop)
+                break;
+            nanosleep(&(struct timespec) {0, PCAP_DRAIN_INTERVAL_NS}, NULL);
+            continue;
+        }
+
+        size_t off = tail & (pcap->size - 1);
+        size_t n = MIN(head - tail, pcap->size - off);
+        if (fwrite(pcap->ring + off, 1, n, pcap->file) != n) {
+            fprintf(stderr, "pcap: write failed: %s\n", strerror(errno));
+            break;
+        }
+        tail += n;
+        __atomic_store_n(&pcap->tail, tail, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+static bool pcap_write_headers(net_pcap_t *pcap)
+{
+    uint8_t shb[28], idb[20];
+
+    pcap_put32(shb, PCAPNG_SHB);
+    pcap_put32(shb + 4, sizeof(shb));
+    pcap_put32(shb + 8, PCAPNG_BYTE_ORDER_MAGIC);
+    pcap_put16(shb + 12, 1); /* version 1.0 */
+    pcap_put16(shb + 14, 0);
+    pcap_put32(shb + 16, UINT32_MAX); /* section length unknown */
+    pcap_put32(shb + 20, UINT32_MAX);
+    pcap_put32(shb + 24, sizeof(shb));
+
+    /* Ethernet, no snap length, default (microsecond) timestamps */
+    pcap_put32(idb, PCAPNG_IDB);
+    pcap_put32(idb + 4, sizeof(idb));
+    pcap_put16(idb + 8, PCAPNG_LINKTYPE_ETHERNET);
+    pcap_put16(idb + 10, 0);
+    pcap_put32(idb + 12, 0);
+    pcap_put32(idb + 16, sizeof(idb));
+
+    return fwrite(shb, 1, sizeof(shb), pcap->file) == sizeof(shb) &&
+           fwrite(idb, 1, sizeof(idb), pcap->file) == sizeof(idb);
+}
+
+static void pcap_write_stats(net_pcap_t *pcap)
+{
+    uint8_t isb[52];
+    uint64_t ts = pcap_host_ns() / 1000;
+
+    pcap_put32(isb, PCAPNG_ISB);
+    pcap_put32(isb + 4, sizeof(isb));
+    pcap_put32(isb + 8, 0);
+    pcap_put32(isb + 12, ts >> 32);
+    pcap_put32(isb + 16, ts);
+    pcap_put16(isb + 20, PCAPNG_ISB_IFRECV);
+    pcap_put16(isb + 22, 8);
+    memcpy(isb + 24, &pcap->captured, 8);
+    pcap_put16(isb + 32, PCAPNG_ISB_IFDROP);
+    pcap_put16(isb + 34, 8);
+    memcpy(isb + 36, &pcap->dropped, 8);
+    pcap_put32(isb + 44, PCAPNG_OPT_END);
+    pcap_put32(isb + 48, sizeof(isb));
+    fwrite(isb, 1, sizeof(isb), pcap->file);
+}
+
+static void net_pcap_close(net_pcap_t *pcap)
+{
+    __atomic_store_n(&pcap->stop, true, __ATOMIC_RELEASE);
+    pthread_join(pcap->thread, NULL);
+    pcap_write_stats(pcap);
+    fclose(pcap->file);
+    fprintf(stderr, "pcap: %llu frames captured, %llu dropped\n",
+            (unsigned long long) pcap->captured,
+            (unsigned long long) pcap->dropped);
+}
+
+static void pcap_close_all(void)
+{
+    while (pcap_open_list) {
+        net_pcap_t *pcap = pcap_open_list;
+        pcap_open_list = pcap->next;
+        net_pcap_close(pcap);
+    }
+}
+
+net_pcap_t *net_pcap_open(const char *path, uint64_t limit)
+{
+    static bool registered;
+    net_pcap_t *pcap = calloc(1, sizeof(*pcap));
+    if (!pcap)
+        return NULL;
+    pcap->size = NET_PCAP_RING_SIZE;
+    pcap->ring = malloc(pcap->size);
+    pcap->file = fopen(path, "wb");
+    if (!pcap->ring || !pcap->file) {
+        fprintf(stderr, "pcap: cannot open %s: %s\n", path, strerror(errno));
+        goto fail;
+    }
+    if (!pcap_write_headers(pcap)) {
+        fprintf(stderr, "pcap: cannot write %s\n", path);
+        goto fail;
+    }
+    /* The limit covers packet blocks, which is what the producer counts */
+    pcap->limit = limit;
+    if (pthread_create(&pcap->thread, NULL, pcap_drain_thread, pcap) != 0) {
+        fprintf(stderr, "pcap: failed to start writer thread\n");
+        goto fail;
+    }
+
+    pcap->next = pcap_open_list;
+    pcap_open_list = pcap;
+    if (!registered) {
+        registered = true;
+        atexit(pcap_close_all);
+    }
+    return pcap;
+
+fail:
+    if (pcap->file)
+        fclose(pcap->file);
+    free(pcap->ring);
+    free(pcap);
+    return NULL;
+}
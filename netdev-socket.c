@@ -0,0 +1,307 @@
+/*
+ * AF_UNIX datagram network backend for guest-to-guest traffic
+ *
+ * Guests started with the same socket path share one Ethernet segment
+ * without root privileges or NAT. The first one to bind the path hosts an
+ * in-process L2 learning switch; every later guest binds a private address
+ * next to it, announces itself with an empty datagram and from then on
+ * exchanges plain Ethernet frames (one per datagram) with the switch.
+ *
+ * The switch learns the source MAC of every frame and forwards unicast
+ * frames to the port they were last seen on, flooding broadcast, multicast
+ * and unknown destinations to every other port. Members that go away are
+ * dropped from the port list when a send to them fails. The guest that hosts
+ * the switch has to outlive the others.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "netdev.h"
+
+#define LOCAL_PORT (-1)
+
+/* Removed at exit so that the next guest can take the name over */
+static const char *bound_path;
+
+static void net_socket_cleanup(void)
+{
+    if (bound_path)
+        unlink(bound_path);
+}
+
+static bool net_socket_addr(struct sockaddr_un *addr, const char *path)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "socket path too long: %s\n", path);
+        return false;
+    }
+    strcpy(addr->sun_path, path);
+    return true;
+}
+
+static bool net_socket_bind(net_socket_options_t *sock, const char *path)
+{
+    if (!net_socket_addr(&sock->self, path))
+        return false;
+    return bind(sock->fd, (struct sockaddr *) &sock->self,
+                sizeof(sock->self)) == 0;
+}
+
+/* A socket file left behind by a guest that exited refuses datagrams */
+static bool net_socket_is_stale(const struct sockaddr_un *addr)
+{
+    int fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (fd < 0)
+        return false;
+    int ret = connect(fd, (const struct sockaddr *) addr, sizeof(*addr));
+    bool stale = ret < 0 && errno == ECONNREFUSED;
+    close(fd);
+    return stale;
+}
+
+static int net_socket_find_port(net_socket_options_t *sock,
+                                const struct sockaddr_un *addr)
+{
+    for (int i = 0; i < sock->n_ports; i++) {
+        if (!strcmp(sock->port[i].sun_path, addr->sun_path))
+            return i;
+    }
+    return -2;
+}
+
+static int net_socket_add_port(net_socket_options_t *sock,
+                               const struct sockaddr_un *addr)
+{
+    int port = net_socket_find_port(sock, addr);
+    if (port >= 0)
+        return port;
+    if (sock->n_ports == NET_SOCKET_PORTS_MAX) {
+        fprintf(stderr, "[SOCKET] switch full, ignoring %s\n",
+                addr->sun_path);
+        return -2;
+    }
+    sock->port[sock->n_ports] = *addr;
+    return sock->n_ports++;
+}
+
+/* Forget a member that has gone away, along with the MACs learned on it */
+static void net_socket_del_port(net_socket_options_t *sock, int port)
+{
+    int last = --sock->n_ports;
+    sock->port[port] = sock->port[last];
+    for (int i = 0; i < sock->n_fdb;) {
+        if (sock->fdb[i].port == port) {
+            sock->fdb[i] = sock->fdb[--sock->n_fdb];
+            continue;
+        }
+        if (sock->fdb[i].port == last)
+            sock->fdb[i].port = port;
+        i++;
+    }
+    sock->fdb_next = 0;
+}
+
+static int net_socket_lookup(net_socket_options_t *sock, const uint8_t *mac)
+{
+    for (int i = 0; i < sock->n_fdb; i++) {
+        if (!memcmp(sock->fdb[i].mac, mac, 6))
+            return sock->fdb[i].port;
+    }
+    return -2;
+}
+
+static void net_socket_learn(net_socket_options_t *sock,
+                             const uint8_t *mac,
+                             int port)
+{
+    /* Group addresses are never valid sources */
+    if (mac[0] & 1)
+        return;
+    for (int i = 0; i < sock->n_fdb; i++) {
+        if (!memcmp(sock->fdb[i].mac, mac, 6)) {
+            sock->fdb[i].port = port;
+            return;
+        }
+    }
+    int i = sock->n_fdb;
+    if (i < NET_SOCKET_FDB_SIZE) {
+        sock->n_fdb++;
+    } else {
+        i = sock->fdb_next;
+        sock->fdb_next = (i + 1) % NET_SOCKET_FDB_SIZE;
+    }
+    memcpy(sock->fdb[i].mac, mac, 6);
+    sock->fdb[i].port = port;
+}
+
+/* Send one datagram. Returns false if the peer no longer exists; a full
+ * socket buffer drops the frame, like a congested link would.
+ */
+static bool net_socket_sendto(net_socket_options_t *sock,
+                              const struct sockaddr_un *addr,
+                              const uint8_t *frame,
+                              size_t len)
+{
+    if (sendto(sock->fd, frame, len, 0, (const struct sockaddr *) addr,
+               sizeof(*addr)) >= 0)
+        return true;
+    return errno != ECONNREFUSED && errno != ENOENT;
+}
+
+/* Switch a frame that arrived on 'from'. Returns true if it is also meant
+ * for the local guest.
+ */
+static bool net_socket_forward(net_socket_options_t *sock,
+                               const uint8_t *frame,
+                               size_t len,
+                               int from)
+{
+    if (len < 14)
+        return false;
+    net_socket_learn(sock, frame + 6, from);
+
+    int to = frame[0] & 1 ? -2 : net_socket_lookup(sock, frame);
+    if (to == LOCAL_PORT)
+        return from != LOCAL_PORT;
+    if (to >= 0) {
+        if (to != from &&
+            !net_socket_sendto(sock, &sock->port[to], frame, len))
+            net_socket_del_port(sock, to);
+        return false;
+    }
+
+    /* Flood; walk backwards so that removing a port keeps the walk valid */
+    for (int i = sock->n_ports - 1; i >= 0; i--) {
+        if (i != from &&
+            !net_socket_sendto(sock, &sock->port[i], frame, len))
+            net_socket_del_port(sock, i);
+    }
+    return from != LOCAL_PORT;
+}
+
+void net_socket_send(net_socket_options_t *sock,
+                     const uint8_t *frame,
+                     size_t len)
+{
+    if (sock->is_switch) {
+        net_socket_forward(sock, frame, len, LOCAL_PORT);
+        return;
+    }
+    if (!net_socket_sendto(sock, &sock->hub, frame, len)) {
+        static bool warned;
+        if (!warned) {
+            warned = true;
+            fprintf(stderr, "[SOCKET] switch at %s has gone away\n",
+                    sock->hub.sun_path);
+        }
+    }
+}
+
+/* Return the next frame for the guest, or NULL if none is pending. On the
+ * switch this also forwards traffic between the other members, so it stops
+ * doing so while a frame for the local guest is held.
+ */
+const uint8_t *net_socket_peek(net_socket_options_t *sock, size_t *len)
+{
+    while (!sock->rx_len) {
+        struct sockaddr_un from = {0};
+        socklen_t from_len = sizeof(from);
+        ssize_t n = recvfrom(sock->fd, sock->rx_frame, sizeof(sock->rx_frame),
+                             0, (struct sockaddr *) &from, &from_len);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                fprintf(stderr, "[SOCKET] recvfrom: %s\n", strerror(errno));
+            return NULL;
+        }
+        if (!sock->is_switch) {
+            sock->rx_len = n;
+            break;
+        }
+
+        /* Unnamed senders cannot be replied to */
+        if (from_len <= offsetof(struct sockaddr_un, sun_path))
+            continue;
+        int port = net_socket_add_port(sock, &from);
+        if (port < 0 || n == 0) /* full, or a join request */
+            continue;
+        if (net_socket_forward(sock, sock->rx_frame, n, port))
+            sock->rx_len = n;
+    }
+    *len = sock->rx_len;
+    return sock->rx_frame;
+}
+
+void net_socket_release(net_socket_options_t *sock)
+{
+    sock->rx_len = 0;
+}
+
+int net_init_socket(netdev_t *netdev)
+{
+    net_socket_options_t *sock = (net_socket_options_t *) netdev->op;
+    const char *path = netdev->name ? netdev->name : NET_SOCKET_PATH_DEFAULT;
+
+    memset(sock, 0, sizeof(*sock));
+    /* Frames are not steered, so a single queue pair is served */
+    netdev->queues = 1;
+
+    sock->fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (sock->fd < 0) {
+        fprintf(stderr, "failed to create socket: %s\n", strerror(errno));
+        return -1;
+    }
+    /* Leave room for bursts of full-sized frames */
+    int bufsize = 1 << 20;
+    setsockopt(sock->fd, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+    setsockopt(sock->fd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+
+    if (!net_socket_addr(&sock->hub, path))
+        goto fail;
+    bool bound = net_socket_bind(sock, path);
+    if (!bound && errno == EADDRINUSE && net_socket_is_stale(&sock->hub)) {
+        unlink(path);
+        bound = net_socket_bind(sock, path);
+    }
+
+    if (bound) {
+        sock->is_switch = true;
+        fprintf(stderr, "socket network: hosting switch at %s\n", path);
+    } else if (errno != EADDRINUSE) {
+        fprintf(stderr, "failed to bind %s: %s\n", path, strerror(errno));
+        goto fail;
+    } else {
+        char self[sizeof(sock->self.sun_path)];
+        snprintf(self, sizeof(self), "%s.%d", path, (int) getpid());
+        unlink(self);
+        if (!net_socket_bind(sock, self)) {
+            fprintf(stderr, "failed to bind %s: %s\n", self, strerror(errno));
+            goto fail;
+        }
+        /* Announce ourselves so that flooded frames reach us */
+        if (sendto(sock->fd, "", 0, 0, (struct sockaddr *) &sock->hub,
+                   sizeof(sock->hub)) < 0) {
+            fprintf(stderr, "failed to join switch at %s: %s\n", path,
+                    strerror(errno));
+            unlink(self);
+            goto fail;
+        }
+        fprintf(stderr, "socket network: joined switch at %s\n", path);
+    }
+
+    fcntl(sock->fd, F_SETFL, fcntl(sock->fd, F_GETFL, 0) | O_NONBLOCK);
+    bound_path = sock->self.sun_path;
+    atexit(net_socket_cleanup);
+    return 0;
+
+fail:
+    close(sock->fd);
+    return -1;
+}
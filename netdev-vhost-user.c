@@ -0,0 +1,344 @@
+/*
+ * vhost-user front-end for virtio-net
+ *
+ * The RX/TX queue pair is serviced by a separate back-end process, such as a
+ * software switch, which reaches the rings and packet buffers directly in
+ * guest RAM. For that to work, guest RAM is allocated from a memfd that is
+ * handed to the back-end over the control socket. Each ring gets an eventfd
+ * that semu writes to when the guest notifies the queue; the back-end in
+ * turn writes to a single call eventfd, shared by both rings, after it has
+ * used buffers, and semu raises the device interrupt from that.
+ *
+ * The control queue stays in semu, and so do feature negotiation and the
+ * device registers: the back-end is configured when the driver sets
+ * DRIVER_OK and stopped again on device reset.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+
+#include "netdev.h"
+#include "vhost-user.h"
+
+/* Guest RAM, shared with the back-end */
+static struct {
+    void *base;
+    size_t size;
+    int fd;
+} vhost_ram = {.fd = -1};
+
+void *net_vhost_user_alloc_ram(size_t size)
+{
+    int fd = memfd_create("semu-ram", MFD_CLOEXEC);
+    if (fd < 0 || ftruncate(fd, size) < 0) {
+        fprintf(stderr, "[VHOST-USER] cannot create shared RAM: %s\n",
+                strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return MAP_FAILED;
+    }
+    void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        close(fd);
+        return MAP_FAILED;
+    }
+    vhost_ram.base = base, vhost_ram.size = size, vhost_ram.fd = fd;
+    return base;
+}
+
+static bool vhost_send(net_vhost_user_options_t *vu,
+                       struct vhost_user_msg *msg,
+                       const int *fds,
+                       int nfds)
+{
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int) * VHOST_USER_MEM_REGIONS_MAX)];
+    } control;
+    struct iovec iov = {msg, VHOST_USER_HDR_SIZE + msg->size};
+    struct msghdr mh = {.msg_iov = &iov, .msg_iovlen = 1};
+
+    msg->flags = VHOST_USER_VERSION;
+    if (nfds) {
+        memset(&control, 0, sizeof(control));
+        mh.msg_control = control.buf;
+        mh.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+    }
+
+    ssize_t n;
+    do {
+        n = sendmsg(vu->fd, &mh, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    if (n != (ssize_t) iov.iov_len) {
+        fprintf(stderr, "[VHOST-USER] request %u failed: %s\n", msg->request,
+                n < 0 ? strerror(errno) : "short write");
+        return false;
+    }
+    return true;
+}
+
+static bool vhost_recv_all(int fd, void *buf, size_t len)
+{
+    while (len) {
+        ssize_t n = recv(fd, buf, len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        buf = (uint8_t *) buf + n, len -= n;
+    }
+    return true;
+}
+
+/* Wait for the reply to 'request', with a payload of 'size' bytes */
+static bool vhost_reply(net_vhost_user_options_t *vu,
+                        uint32_t request,
+                        struct vhost_user_msg *msg,
+                        uint32_t size)
+{
+    if (!vhost_recv_all(vu->fd, msg, VHOST_USER_HDR_SIZE) ||
+        msg->size > sizeof(msg->payload) ||
+        !vhost_recv_all(vu->fd, &msg->payload, msg->size)) {
+        fprintf(stderr, "[VHOST-USER] back-end closed the connection\n");
+        return false;
+    }
+    if (msg->request != request || !(msg->flags & VHOST_USER_REPLY) ||
+        msg->size != size) {
+        fprintf(stderr, "[VHOST-USER] unexpected reply to request %u\n",
+                request);
+        return false;
+    }
+    return true;
+}
+
+static bool vhost_get_u64(net_vhost_user_options_t *vu,
+                          uint32_t request,
+                          uint64_t *value)
+{
+    struct vhost_user_msg msg = {.request = request};
+    if (!vhost_send(vu, &msg, NULL, 0) ||
+        !vhost_reply(vu, request, &msg, sizeof(msg.payload.u64)))
+        return false;
+    *value = msg.payload.u64;
+    return true;
+}
+
+static bool vhost_set_u64(net_vhost_user_options_t *vu,
+                          uint32_t request,
+                          uint64_t value)
+{
+    struct vhost_user_msg msg = {
+        .request = request,
+        .size = sizeof(msg.payload.u64),
+        .payload.u64 = value,
+    };
+    return vhost_send(vu, &msg, NULL, 0);
+}
+
+static bool vhost_set_state(net_vhost_user_options_t *vu,
+                            uint32_t request,
+                            uint32_t index,
+                            uint32_t num)
+{
+    struct vhost_user_msg msg = {
+        .request = request,
+        .size = sizeof(msg.payload.state),
+        .payload.state = {index, num},
+    };
+    return vhost_send(vu, &msg, NULL, 0);
+}
+
+static bool vhost_set_fd(net_vhost_user_options_t *vu,
+                         uint32_t request,
+                         uint32_t index,
+                         int fd)
+{
+    struct vhost_user_msg msg = {
+        .request = request,
+        .size = sizeof(msg.payload.u64),
+        .payload.u64 = index,
+    };
+    return vhost_send(vu, &msg, &fd, 1);
+}
+
+static bool vhost_set_mem_table(net_vhost_user_options_t *vu)
+{
+    struct vhost_user_msg msg = {
+        .request = VHOST_USER_SET_MEM_TABLE,
+        .size = offsetof(vhost_user_memory_t, region) +
+                sizeof(vhost_user_mem_region_t),
+    };
+    msg.payload.memory.nregions = 1;
+    msg.payload.memory.region[0] = (vhost_user_mem_region_t) {
+        .guest_addr = 0, /* RAM starts at guest physical address 0 */
+        .size = vhost_ram.size,
+        .user_addr = (uintptr_t) vhost_ram.base,
+        .mmap_offset = 0,
+    };
+    return vhost_send(vu, &msg, &vhost_ram.fd, 1);
+}
+
+bool net_vhost_user_start(net_vhost_user_options_t *vu,
+                          uint64_t features,
+                          const net_vhost_user_ring_t *ring)
+{
+    if (vu->started)
+        return true;
+    if (vu->protocol)
+        features |= VHOST_USER_F_PROTOCOL_FEATURES;
+    if (!vhost_set_u64(vu, VHOST_USER_SET_FEATURES, features) ||
+        !vhost_set_mem_table(vu))
+        return false;
+
+    for (uint32_t i = 0; i < NET_VHOST_USER_RINGS; i++) {
+        struct vhost_user_msg msg = {
+            .request = VHOST_USER_SET_VRING_ADDR,
+            .size = sizeof(msg.payload.addr),
+            .payload.addr =
+                {
+                    .index = i,
+                    .desc = (uintptr_t) ring[i].desc,
+                    .used = (uintptr_t) ring[i].used,
+                    .avail = (uintptr_t) ring[i].avail,
+                },
+        };
+        if (!vhost_set_state(vu, VHOST_USER_SET_VRING_NUM, i, ring[i].num) ||
+            !vhost_set_state(vu, VHOST_USER_SET_VRING_BASE, i,
+                             ring[i].last_avail) ||
+            !vhost_send(vu, &msg, NULL, 0) ||
+            !vhost_set_fd(vu, VHOST_USER_SET_VRING_KICK, i, vu->kick_fd[i]) ||
+            !vhost_set_fd(vu, VHOST_USER_SET_VRING_CALL, i, vu->call_fd))
+            return false;
+    }
+    for (uint32_t i = 0; vu->protocol && i < NET_VHOST_USER_RINGS; i++) {
+        if (!vhost_set_state(vu, VHOST_USER_SET_VRING_ENABLE, i, 1))
+            return false;
+    }
+    vu->started = true;
+
+    /* The guest may have posted buffers before the back-end was listening */
+    for (int i = 0; i < NET_VHOST_USER_RINGS; i++)
+        net_vhost_user_kick(vu, i);
+    return true;
+}
+
+/* Stop the rings. GET_VRING_BASE only returns once the back-end no longer
+ * touches a ring, so guest RAM may be reused afterwards.
+ */
+void net_vhost_user_stop(net_vhost_user_options_t *vu)
+{
+    if (!vu->started)
+        return;
+    vu->started = false;
+    for (uint32_t i = 0; i < NET_VHOST_USER_RINGS; i++) {
+        struct vhost_user_msg msg = {
+            .request = VHOST_USER_GET_VRING_BASE,
+            .size = sizeof(msg.payload.state),
+            .payload.state = {i, 0},
+        };
+        if (vu->protocol)
+            vhost_set_state(vu, VHOST_USER_SET_VRING_ENABLE, i, 0);
+        if (vhost_send(vu, &msg, NULL, 0))
+            vhost_reply(vu, msg.request, &msg, sizeof(msg.payload.state));
+    }
+    net_vhost_user_ack(vu);
+}
+
+void net_vhost_user_kick(net_vhost_user_options_t *vu, int ring)
+{
+    uint64_t one = 1;
+    if (vu->started && write(vu->kick_fd[ring], &one, sizeof(one)) < 0 &&
+        errno != EAGAIN)
+        fprintf(stderr, "[VHOST-USER] kick failed: %s\n", strerror(errno));
+}
+
+/* Consume pending calls. Returns true if the back-end used buffers since
+ * the last time.
+ */
+bool net_vhost_user_ack(net_vhost_user_options_t *vu)
+{
+    uint64_t calls;
+    return read(vu->call_fd, &calls, sizeof(calls)) == sizeof(calls);
+}
+
+int net_init_vhost_user(netdev_t *netdev)
+{
+    net_vhost_user_options_t *vu = (net_vhost_user_options_t *) netdev->op;
+    const char *path =
+        netdev->name ? netdev->name : NET_VHOST_USER_PATH_DEFAULT;
+
+    memset(vu, 0, sizeof(*vu));
+    vu->call_fd = vu->kick_fd[0] = vu->kick_fd[1] = -1;
+    /* Only the first pair is handed to the back-end */
+    netdev->queues = 1;
+
+    if (vhost_ram.fd < 0) {
+        fprintf(stderr, "[VHOST-USER] guest RAM is not shareable\n");
+        return -1;
+    }
+
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    vu->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (vu->fd < 0 ||
+        connect(vu->fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "[VHOST-USER] cannot connect to %s: %s\n", path,
+                strerror(errno));
+        goto fail;
+    }
+
+    struct vhost_user_msg owner = {.request = VHOST_USER_SET_OWNER};
+    uint64_t protocol;
+    if (!vhost_send(vu, &owner, NULL, 0) ||
+        !vhost_get_u64(vu, VHOST_USER_GET_FEATURES, &vu->features))
+        goto fail;
+    if (!(vu->features & VHOST_F_VERSION_1)) {
+        fprintf(stderr, "[VHOST-USER] back-end lacks VIRTIO_F_VERSION_1\n");
+        goto fail;
+    }
+    /* No protocol extension is used, but negotiating the feature still
+     * changes how rings are enabled.
+     */
+    vu->protocol = vu->features & VHOST_USER_F_PROTOCOL_FEATURES;
+    if (vu->protocol &&
+        (!vhost_get_u64(vu, VHOST_USER_GET_PROTOCOL_FEATURES, &protocol) ||
+         !vhost_set_u64(vu, VHOST_USER_SET_PROTOCOL_FEATURES, 0)))
+        goto fail;
+
+    vu->call_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    for (int i = 0; i < NET_VHOST_USER_RINGS; i++)
+        vu->kick_fd[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (vu->call_fd < 0 || vu->kick_fd[0] < 0 || vu->kick_fd[1] < 0) {
+        fprintf(stderr, "[VHOST-USER] eventfd: %s\n", strerror(errno));
+        goto fail;
+    }
+
+    fprintf(stderr, "vhost-user network: connected to %s\n", path);
+    return 0;
+
+fail:
+    for (int i = 0; i < NET_VHOST_USER_RINGS; i++) {
+        if (vu->kick_fd[i] >= 0)
+            close(vu->kick_fd[i]);
+    }
+    if (vu->call_fd >= 0)
+        close(vu->call_fd);
+    if (vu->fd >= 0)
+        close(vu->fd);
+    return -1;
+}
@@ -29,8 +29,12 @@ static int find_net_dev_idx(const char *net_type, const char **netlookup)
     if (!net_type)
         return -1;
 
+    /* Backend names may be spelled with dashes, as in "vhost-user" */
     for (int i = 0; netlookup[i]; i++) {
-        if (!strcmp(net_type, netlookup[i]))
+        const char *a = net_type, *b = netlookup[i];
+        while (*a && (*a == *b || (*a == '-' && *b == '_')))
+            a++, b++;
+        if (!*a && !*b)
             return i;
     }
     return -1;
@@ -43,26 +47,81 @@ static int net_init_user(netdev_t *netdev);
 static int net_init_tap(netdev_t *netdev)
 {
     net_tap_options_t *tap = (net_tap_options_t *) netdev->op;
-    tap->tap_fd = open("/dev/net/tun", O_RDWR);
-    if (tap->tap_fd < 0) {
-        fprintf(stderr, "failed to open TAP device: %s\n", strerror(errno));
-        return false;
-    }
+    tap->queues = netdev->queues;
 
-    /* Specify persistent tap device */
-    struct ifreq ifreq = {.ifr_flags = IFF_TAP | IFF_NO_PI};
+    /* Specify persistent tap device. Every frame carries a virtio-net
+     * header so that checksum and segmentation offloads pass straight
+     * through between the guest and the host kernel. With several queue
+     * pairs, each one gets its own fd on the same interface.
+     */
+    struct ifreq ifreq = {.ifr_flags = IFF_TAP | IFF_NO_PI | IFF_VNET_HDR};
+    if (tap->queues > 1)
+        ifreq.ifr_flags |= IFF_MULTI_QUEUE;
     strncpy(ifreq.ifr_name, "tap%d", sizeof(ifreq.ifr_name));
-    if (ioctl(tap->tap_fd, TUNSETIFF, &ifreq) < 0) {
-        fprintf(stderr, "failed to allocate TAP device: %s\n", strerror(errno));
-        return false;
+    for (int i = 0; i < tap->queues; i++) {
+        int fd = tap->tap_fd[i] = open("/dev/net/tun", O_RDWR);
+        if (fd < 0) {
+            fprintf(stderr, "failed to open TAP device: %s\n",
+                    strerror(errno));
+            return false;
+        }
+        /* TUNSETIFF writes the allocated name back for the next queue */
+        if (ioctl(fd, TUNSETIFF, &ifreq) < 0) {
+            fprintf(stderr, "failed to allocate TAP device: %s\n",
+                    strerror(errno));
+            return false;
+        }
+
+        int hdr_size = NET_VNET_HDR_SIZE;
+        if (ioctl(fd, TUNSETVNETHDRSZ, &hdr_size) < 0) {
+            fprintf(stderr, "failed to set TAP vnet header size: %s\n",
+                    strerror(errno));
+            return false;
+        }
+        assert(fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) >= 0);
     }
 
-    fprintf(stderr, "allocated TAP interface: %s\n", ifreq.ifr_name);
-    assert(fcntl(tap->tap_fd, F_SETFL,
-                 fcntl(tap->tap_fd, F_GETFL, 0) | O_NONBLOCK) >= 0);
+    fprintf(stderr, "allocated TAP interface: %s (%d queue%s)\n",
+            ifreq.ifr_name, tap->queues, tap->queues > 1 ? "s" : "");
     return 0;
 }
 
+void net_tap_set_offload(net_tap_options_t *tap,
+                         bool csum,
+                         bool tso4,
+                         bool tso6)
+{
+    /* The kernel rejects TSO without checksum offload */
+    unsigned int flags = 0;
+    if (csum) {
+        flags |= TUN_F_CSUM;
+        if (tso4)
+            flags |= TUN_F_TSO4;
+        if (tso6)
+            flags |= TUN_F_TSO6;
+    }
+    for (int i = 0; i < tap->queues; i++) {
+        if (ioctl(tap->tap_fd[i], TUNSETOFFLOAD, flags) < 0)
+            fprintf(stderr, "failed to set TAP offloads: %s\n",
+                    strerror(errno));
+    }
+}
+
+/* Detach the queues the guest does not service, so that the kernel stops
+ * steering flows onto them.
+ */
+static void net_tap_set_queues(net_tap_options_t *tap, int active)
+{
+    if (tap->queues < 2)
+        return;
+    for (int i = 1; i < tap->queues; i++) {
+        struct ifreq ifreq = {
+            .ifr_flags = i < active ? IFF_ATTACH_QUEUE : IFF_DETACH_QUEUE};
+        if (ioctl(tap->tap_fd[i], TUNSETQUEUE, &ifreq) < 0 && errno != EINVAL)
+            fprintf(stderr, "failed to %s TAP queue %d: %s\n",
+                    i < active ? "attach" : "detach", i, strerror(errno));
+    }
+}
 #endif
 
 static int net_init_user(netdev_t *netdev)
@@ -70,13 +129,69 @@ static int net_init_user(netdev_t *netdev)
     net_user_options_t *usr = (net_user_options_t *) netdev->op;
     memset(usr, 0, sizeof(*usr));
     usr->peer = container_of(netdev, virtio_net_state_t, peer);
+    usr->queues = netdev->queues;
+    usr->active_queues = 1;
     net_slirp_init(usr);
 
     return 0;
 }
 
-bool netdev_init(netdev_t *netdev, const char *net_type)
+void netdev_set_queues(netdev_t *netdev, int active)
 {
+    switch (netdev->type) {
+#if !defined(__APPLE__)
+    case NETDEV_IMPL_tap:
+        net_tap_set_queues((net_tap_options_t *) netdev->op, active);
+        break;
+#endif
+    case NETDEV_IMPL_user:
+        /* Read by the slirp thread when it steers frames */
+        __atomic_store_n(&((net_user_options_t *) netdev->op)->active_queues,
+                         active, __ATOMIC_RELAXED);
+        break;
+    default:
+        break;
+    }
+}
+
+/* FNV-1a over the addresses, protocol and ports of an IPv4/IPv6 frame, so
+ * that all frames of a connection land on the same queue.
+ */
+uint32_t netdev_flow_hash(const uint8_t *frame, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    size_t l3 = 14, addr, addr_len, l4;
+    uint8_t proto;
+    if (len < l3)
+        return 0;
+
+    uint16_t type = frame[12] << 8 | frame[13];
+    if (type == 0x0800 && len >= l3 + 20) {
+        addr = l3 + 12, addr_len = 8, proto = frame[l3 + 9];
+        l4 = l3 + (frame[l3] & 0xF) * 4;
+        /* Only the first fragment carries the ports */
+        if ((frame[l3 + 6] & 0x1F) | frame[l3 + 7])
+            l4 = len;
+    } else if (type == 0x86DD && len >= l3 + 40) {
+        addr = l3 + 8, addr_len = 32, proto = frame[l3 + 6];
+        l4 = l3 + 40;
+    } else {
+        return 0;
+    }
+
+    for (size_t i = 0; i < addr_len; i++)
+        hash = (hash ^ frame[addr + i]) * 16777619u;
+    hash = (hash ^ proto) * 16777619u;
+    if ((proto == 6 || proto == 17) && l4 + 4 <= len) {
+        for (size_t i = 0; i < 4; i++)
+            hash = (hash ^ frame[l4 + i]) * 16777619u;
+    }
+    return hash;
+}
+
+bool netdev_init(netdev_t *netdev, const char *net_type, int queues)
+{
+    netdev->queues = queues;
 #if defined(__APPLE__)
     /* macOS: support vmnet (kernel, requires sudo) and user (slirp, no sudo) */
     if (!net_type || strcmp(net_type, "vmnet") == 0) {
@@ -101,7 +216,8 @@ bool netdev_init(netdev_t *netdev, const char *net_type)
                     "mode...\n");
             /* Continue to user mode initialization below */
         } else {
-            /* vmnet init succeeded */
+            /* vmnet init succeeded; it has a single queue */
+            netdev->queues = 1;
             return true;
         }
     }
@@ -125,8 +241,24 @@ bool netdev_init(netdev_t *netdev, const char *net_type)
         return true;
     }
 
+    if (strcmp(net_type, "socket") == 0) {
+        netdev->type = NETDEV_IMPL_socket;
+        netdev->op = malloc(sizeof(net_socket_options_t));
+        if (!netdev->op) {
+            fprintf(stderr, "Failed to allocate memory for socket device\n");
+            return false;
+        }
+        if (net_init_socket(netdev) != 0) {
+            free(netdev->op);
+            netdev->op = NULL;
+            return false;
+        }
+        return true;
+    }
+
     fprintf(stderr,
-            "unsupported network type on macOS: %s (use 'vmnet' or 'user')\n",
+            "unsupported network type on macOS: %s (use 'vmnet', 'user' or "
+            "'socket')\n",
             net_type);
     return false;
 #else
@@ -144,7 +276,11 @@ bool netdev_init(netdev_t *netdev, const char *net_type)
                     #dev);                                               \
             return false;                                                \
         }                                                                \
-        net_init_##dev(netdev);                                          \
+        if (net_init_##dev(netdev) != 0) {                               \
+            free(netdev->op);                                            \
+            netdev->op = NULL;                                           \
+            return false;                                                \
+        }                                                                \
         break;
         SUPPORTED_DEVICES
 #undef _
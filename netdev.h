@@ -1,10 +1,13 @@
 #pragma once
 
 #include <poll.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <sys/socket.h>
 #include <sys/uio.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 #include "minislirp/src/libslirp.h"
@@ -17,11 +20,14 @@ typedef struct netdev netdev_t;
 #if defined(__APPLE__)
 #define SUPPORTED_DEVICES   \
         _(vmnet)            \
-        _(user)
+        _(user)             \
+        _(socket)
 #else
 #define SUPPORTED_DEVICES   \
         _(tap)              \
-        _(user)
+        _(user)             \
+        _(socket)           \
+        _(vhost_user)
 #endif
 /* clang-format on */
 
@@ -31,10 +37,26 @@ typedef enum {
 #undef _
 } netdev_impl_t;
 
+/* Size of the virtio-net header (including num_buffers) prepended to every
+ * frame exchanged with a tap device.
+ */
+#define NET_VNET_HDR_SIZE 12
+
+/* Upper bound on the RX/TX queue pairs a backend can serve */
+#define NETDEV_QUEUES_MAX 8
+
 typedef struct {
-    int tap_fd;
+    int tap_fd[NETDEV_QUEUES_MAX]; /* one IFF_MULTI_QUEUE fd per queue pair */
+    int queues;
 } net_tap_options_t;
 
+#if !defined(__APPLE__)
+void net_tap_set_offload(net_tap_options_t *tap,
+                         bool csum,
+                         bool tso4,
+                         bool tso6);
+#endif
+
 /* vmnet (macOS) */
 #if defined(__APPLE__)
 #include <pthread.h>
@@ -73,40 +95,173 @@ void net_vmnet_cleanup(net_vmnet_state_t *state);
 #endif
 
 /* SLIRP (cross-platform userspace network) */
-#define SLIRP_POLL_INTERVAL 100000
-#define SLIRP_PKT_MAX 16384
-#define SLIRP_READ_SIDE 0
-#define SLIRP_WRITE_SIDE 1
+/* Frames move between virtio-net and slirp through single-producer,
+ * single-consumer rings of fixed-size slots. A slot holds one Ethernet frame
+ * at slirp's 1500-byte MTU.
+ */
+#define SLIRP_RING_SLOTS 256 /* power of two */
+#define SLIRP_SLOT_SIZE 2048
+
 typedef struct {
-    semu_timer_t timer;
+    uint32_t head; /* next slot to fill, advanced by the producer */
+    uint32_t tail; /* next slot to drain, advanced by the consumer */
+    uint16_t len[SLIRP_RING_SLOTS];
+    uint8_t (*slot)[SLIRP_SLOT_SIZE];
+} slirp_ring_t;
+
+uint8_t *slirp_ring_reserve(slirp_ring_t *ring);
+void slirp_ring_commit(slirp_ring_t *ring, size_t len);
+const uint8_t *slirp_ring_peek(slirp_ring_t *ring, size_t *len);
+void slirp_ring_release(slirp_ring_t *ring);
+bool slirp_ring_empty(slirp_ring_t *ring);
+
+typedef struct slirp_timer {
     Slirp *slirp;
     SlirpTimerId id;
     void *cb_opaque;
-    void (*cb)(void *opaque);
-    int64_t expire_timer_msec;
+    int64_t expire_timer_msec; /* absolute, -1 when disarmed */
+    struct slirp_timer *next;
 } slirp_timer;
 
+/* Slirp runs on its own thread, which owns the Slirp instance, its sockets
+ * and timers. The emulator thread only touches the rings: it writes a byte
+ * to wake_fd after queueing frames for slirp, and the network thread writes
+ * to notify_fd after queueing frames for the guest.
+ */
 typedef struct {
     Slirp *slirp;
-    int guest_to_host_channel[2];
-    int host_to_guest_channel[2];
+    pthread_t thread;
+    int wake_fd[2];
+    int notify_fd[2];
+    bool kicked;      /* a wake byte is pending on wake_fd */
+    bool rx_notified; /* a notify byte is pending on notify_fd */
+    /* Frames from slirp are steered by flow onto one ring per active
+     * queue pair; frames from the guest share a single ring.
+     */
+    slirp_ring_t to_guest[NETDEV_QUEUES_MAX];
+    slirp_ring_t to_slirp;
+    int queues;
+    int active_queues;
     int pfd_len;
     int pfd_size;
     struct pollfd *pfd;
-    slirp_timer *timer;
+    slirp_timer *timers;
     void *peer;
 } net_user_options_t;
 
 Slirp *slirp_create(net_user_options_t *usr, SlirpConfig *cfg);
 int net_slirp_init(net_user_options_t *usr);
-int net_slirp_read(net_user_options_t *usr);
+void net_slirp_kick(net_user_options_t *usr);
+bool net_slirp_rx_ack(net_user_options_t *usr);
+int net_slirp_notify_fd(net_user_options_t *usr);
 int semu_slirp_add_poll_socket(slirp_os_socket fd, int events, void *opaque);
 int semu_slirp_get_revents(int idx, void *opaque);
 
+/* socket: guests on the same host share an L2 segment over AF_UNIX datagram
+ * sockets. The first guest to bind the rendezvous path hosts a learning
+ * switch; later ones bind "PATH.PID", join it with an empty datagram and
+ * exchange plain Ethernet frames through it.
+ */
+#define NET_SOCKET_PATH_DEFAULT "/tmp/semu-net.sock"
+#define NET_SOCKET_PORTS_MAX 32
+#define NET_SOCKET_FDB_SIZE 256
+#define NET_SOCKET_FRAME_MAX 65536
+
+typedef struct {
+    int fd;
+    bool is_switch;
+    struct sockaddr_un self;
+    struct sockaddr_un hub; /* the switch, for members */
+    /* Switch state: member ports and the MAC table. Port -1 is the local
+     * guest.
+     */
+    struct sockaddr_un port[NET_SOCKET_PORTS_MAX];
+    int n_ports;
+    struct {
+        uint8_t mac[6];
+        int port;
+    } fdb[NET_SOCKET_FDB_SIZE];
+    int n_fdb;
+    int fdb_next; /* entry to recycle when the table is full */
+    /* One frame held for the guest until it posts a receive buffer */
+    size_t rx_len;
+    uint8_t rx_frame[NET_SOCKET_FRAME_MAX];
+    uint8_t tx_frame[NET_SOCKET_FRAME_MAX];
+} net_socket_options_t;
+
+int net_init_socket(netdev_t *netdev);
+void net_socket_send(net_socket_options_t *sock,
+                     const uint8_t *frame,
+                     size_t len);
+const uint8_t *net_socket_peek(net_socket_options_t *sock, size_t *len);
+void net_socket_release(net_socket_options_t *sock);
+
+#if !defined(__APPLE__)
+/* vhost-user: an external back-end process services the RX/TX queues straight
+ * from guest RAM, which it maps from the memfd backing it. semu keeps the
+ * device registers and the control queue, forwards the guest's queue
+ * notifications as kicks and turns the back-end's calls into interrupts.
+ */
+#define NET_VHOST_USER_PATH_DEFAULT "/tmp/semu-vhost-user.sock"
+#define NET_VHOST_USER_RINGS 2 /* a single RX/TX pair */
+
+typedef struct {
+    uint32_t num;
+    void *desc, *avail, *used;
+    uint16_t last_avail;
+} net_vhost_user_ring_t;
+
+typedef struct {
+    int fd;            /* control connection to the back-end */
+    uint64_t features; /* offered by the back-end */
+    bool protocol;     /* rings have to be enabled explicitly */
+    int kick_fd[NET_VHOST_USER_RINGS];
+    int call_fd; /* shared by the rings */
+    bool started;
+} net_vhost_user_options_t;
+
+void *net_vhost_user_alloc_ram(size_t size);
+int net_init_vhost_user(netdev_t *netdev);
+bool net_vhost_user_start(net_vhost_user_options_t *vu,
+                          uint64_t features,
+                          const net_vhost_user_ring_t *ring);
+void net_vhost_user_stop(net_vhost_user_options_t *vu);
+void net_vhost_user_kick(net_vhost_user_options_t *vu, int ring);
+bool net_vhost_user_ack(net_vhost_user_options_t *vu);
+#endif
+
+/* pcapng capture of the frames a virtio-net device moves */
+#define NET_PCAP_RING_SIZE (4 << 20) /* power of two */
+
+typedef struct net_pcap {
+    FILE *file;
+    uint8_t *ring;
+    size_t size;
+    uint64_t head;  /* bytes queued, advanced by the emulator thread */
+    uint64_t tail;  /* bytes written, advanced by the writer thread */
+    uint64_t limit; /* cap on queued packet bytes, 0 for none */
+    uint64_t captured, dropped;
+    bool stop;
+    pthread_t thread;
+    struct net_pcap *next;
+} net_pcap_t;
+
+net_pcap_t *net_pcap_open(const char *path, uint64_t limit);
+void net_pcap_capture(net_pcap_t *pcap,
+                      const struct iovec *iov,
+                      size_t niov,
+                      size_t skip,
+                      size_t len,
+                      bool tx,
+                      uint64_t guest_ns);
+
 struct netdev {
-    char *name;
+    char *name; /* backend endpoint, e.g. the socket path */
     netdev_impl_t type;
     void *op;
+    int queues;
 };
 
-bool netdev_init(netdev_t *nedtev, const char *net_type);
+bool netdev_init(netdev_t *nedtev, const char *net_type, int queues);
+void netdev_set_queues(netdev_t *netdev, int active);
+uint32_t netdev_flow_hash(const uint8_t *frame, size_t len);
@@ -13,6 +13,7 @@ void plic_update_interrupts(vm_t *vm, plic_state_t *plic)
     for (uint32_t i = 0; i < vm->n_hart; i++) {
         if (plic->ip & plic->ie[i]) {
             vm->hart[i]->sip |= RV_INT_SEI_BIT;
+            vm->hart[i]->irq_check = true;
             /* Clear WFI flag when external interrupt is injected */
             vm->hart[i]->in_wfi = false;
         } else {
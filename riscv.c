@@ -1037,6 +1037,7 @@ static void op_sret(hart_t *vm)
         mmu_invalidate(vm);
     vm->s_mode = vm->sstatus_spp;
     vm->sstatus_sie = vm->sstatus_spie;
+    vm->irq_check = true;
 
     /* After the booting process is complete, initrd will be loaded. At this
      * point, the sytstem will switch to U mode for the first time. Therefore,
@@ -1072,6 +1073,8 @@ static void op_privileged(hart_t *vm, uint32_t insn)
         op_sret(vm);
         break;
     case 0b000100000101: /* PRIV_WFI */
+        /* The idle time must not enter the rdtime rate */
+        vm->time_idle = true;
         /* Call the WFI callback if available */
         if (vm->wfi)
             vm->wfi(vm);
@@ -1095,14 +1098,104 @@ static inline void set_dest_idx(hart_t *vm, uint8_t rd, uint32_t x)
 #define SIP_MASK (0              | 0              | RV_INT_SSI_BIT)
 /* clang-format on */
 
+/* Guest view of the time CSR. While the boot-time fake clock is active every
+ * read must reach semu_timer_get(), since its tick rate is calibrated by call
+ * count. Afterwards reads are served from the host sample taken by
+ * vm_time_refresh(), advanced by the retired instruction count at the last
+ * measured ticks-per-instruction rate and capped at the last observed clock
+ * step.
+ *
+ * The interpolated value may run ahead of the host clock by up to one step,
+ * so every read is also clamped to the latest value any hart has returned.
+ * All harts run on the emulator thread, which makes that bound shared and
+ * monotonic across harts. Only a write to mtime, seen as a new timer base,
+ * lowers it.
+ */
+static uint64_t vm_time_last;
+static uint64_t vm_time_epoch; /* timer base vm_time_last belongs to */
+
+/* A host clock step longer than this is an idle gap, not a rate sample */
+#define VM_TIME_GAP_MS 10
+
+static uint64_t vm_time_read(hart_t *vm)
+{
+    if (!vm->time_cached)
+        return semu_timer_get(&vm->time);
+
+    /* No interpolation rate measured yet: use the raw timer */
+    uint64_t now;
+    if (!vm->time_rate) {
+        now = semu_timer_get(&vm->time);
+    } else {
+        uint64_t delta =
+            ((vm->instret - vm->time_base_instret) * vm->time_rate) >> 16;
+        if (delta > vm->time_span)
+            delta = vm->time_span;
+        now = vm->time_base + delta;
+    }
+    if (now < vm_time_last)
+        now = vm_time_last;
+    vm_time_last = now;
+    return now;
+}
+
+void vm_time_refresh(hart_t *vm)
+{
+    if (!boot_complete) {
+        vm->time_cached = false;
+        return;
+    }
+
+    uint64_t now = semu_timer_get(&vm->time);
+
+    /* mtime was written: the lower bound restarts on the new timeline */
+    if (vm->time.begin != vm_time_epoch) {
+        vm_time_epoch = vm->time.begin;
+        vm_time_last = now;
+    }
+
+    /* First sample, a new timer base, or the hart sat in WFI since the last
+     * sample: the instructions retired say nothing about the elapsed time, so
+     * start measuring again from this sample.
+     */
+    if (!vm->time_cached || vm->time_epoch != vm->time.begin ||
+        vm->time_idle) {
+        vm->time_cached = true;
+        vm->time_epoch = vm->time.begin;
+        vm->time_idle = false;
+        vm->time_base = now;
+        vm->time_base_instret = vm->instret;
+        vm->time_rate = 0;
+        vm->time_span = 0;
+        return;
+    }
+
+    /* The host clock is coarse; recalibrate only when it has stepped */
+    if (now <= vm->time_base)
+        return;
+
+    uint64_t step = now - vm->time_base;
+    uint64_t retired = vm->instret - vm->time_base_instret;
+    if (step > vm->time.freq / 1000 * VM_TIME_GAP_MS || !retired) {
+        vm->time_rate = 0;
+        vm->time_span = 0;
+    } else {
+        uint64_t rate = (step << 16) / retired;
+        vm->time_rate = rate > (1U << 24) ? (1U << 24) : (uint32_t) rate;
+        vm->time_span = step > UINT32_MAX ? UINT32_MAX : (uint32_t) step;
+    }
+    vm->time_base = now;
+    vm->time_base_instret = vm->instret;
+}
+
 static void csr_read(hart_t *vm, uint16_t addr, uint32_t *value)
 {
     switch (addr) {
     case RV_CSR_TIME:
-        *value = semu_timer_get(&vm->time);
+        *value = vm_time_read(vm);
         return;
     case RV_CSR_TIMEH:
-        *value = semu_timer_get(&vm->time) >> 32;
+        *value = vm_time_read(vm) >> 32;
         return;
     case RV_CSR_INSTRET:
         *value = vm->instret;
@@ -1178,6 +1271,7 @@ static void csr_write(hart_t *vm, uint16_t addr, uint32_t value)
         vm->sstatus_spp = (value & (1 << (8))) != 0;
         vm->sstatus_sum = (value & (1 << (18))) != 0;
         vm->sstatus_mxr = (value & (1 << (19))) != 0;
+        vm->irq_check = true;
         /* Invalidate load/store TLB if SUM or MXR changed */
         if (vm->sstatus_sum != old_sum || vm->sstatus_mxr != old_mxr)
             mmu_invalidate(vm);
@@ -1186,11 +1280,13 @@ static void csr_write(hart_t *vm, uint16_t addr, uint32_t value)
     case RV_CSR_SIE:
         value &= SIE_MASK;
         vm->sie = value;
+        vm->irq_check = true;
         break;
     case RV_CSR_SIP:
         value &= SIP_MASK;
         value |= vm->sip & ~SIP_MASK;
         vm->sip = value;
+        vm->irq_check = true;
         break;
     case RV_CSR_STVEC:
         vm->stvec_addr = value;
@@ -1476,11 +1572,17 @@ void vm_init(hart_t *vm)
     mmu_invalidate(vm);
     vm->ram_load_last_page = 0xFFFFFFFF;
     vm->ram_store_last_page = 0xFFFFFFFF;
+    vm->irq_check = true;
 }
 
 #define PRIV(x) ((emu_state_t *) x->priv)
+/* Only called when vm->irq_check is set. The flag is raised by every point
+ * that may make an interrupt deliverable (sip/sie/sstatus.SIE/privilege
+ * changes), so once evaluated it can be dropped until the next such change.
+ */
 static inline void vm_handle_pending_interrupt(hart_t *vm)
 {
+    vm->irq_check = false;
     if ((vm->sstatus_sie || !vm->s_mode) && (vm->sip & vm->sie)) {
         uint32_t applicable = (vm->sip & vm->sie);
         uint8_t idx = ilog2(applicable);
@@ -1672,10 +1774,12 @@ __attribute__((hot, flatten)) int vm_step_many(hart_t *vm, int steps)
         if (unlikely(executed >= steps))                                       \
             goto L_slow_path;                                                  \
         vm->current_pc = vm->pc;                                               \
-        vm_handle_pending_interrupt(vm);                                       \
-        if (unlikely(vm->pc != vm->current_pc)) {                              \
-            seq_ptr = NULL;                                                    \
-            vm->current_pc = vm->pc;                                           \
+        if (unlikely(vm->irq_check)) {                                         \
+            vm_handle_pending_interrupt(vm);                                   \
+            if (vm->pc != vm->current_pc) {                                    \
+                seq_ptr = NULL;                                                \
+                vm->current_pc = vm->pc;                                       \
+            }                                                                  \
         }                                                                      \
         /* Inline icache lookup */                                             \
         {                                                                      \
@@ -1932,10 +2036,12 @@ L_slow_path:
         return executed;
 
     vm->current_pc = vm->pc;
-    vm_handle_pending_interrupt(vm);
-    if (unlikely(vm->pc != vm->current_pc)) {
-        seq_ptr = NULL;
-        vm->current_pc = vm->pc;
+    if (unlikely(vm->irq_check)) {
+        vm_handle_pending_interrupt(vm);
+        if (vm->pc != vm->current_pc) {
+            seq_ptr = NULL;
+            vm->current_pc = vm->pc;
+        }
     }
 
     /* Fetch instruction */
@@ -1976,9 +2082,10 @@ L_error:
         uint32_t pc = vm->pc;
 
         vm->current_pc = pc;
-        vm_handle_pending_interrupt(vm);
-        if (unlikely(vm->pc != pc)) {
-            seq_ptr = NULL;
+        if (unlikely(vm->irq_check)) {
+            vm_handle_pending_interrupt(vm);
+            if (vm->pc != pc)
+                seq_ptr = NULL;
         }
         vm->current_pc = vm->pc;
         if (likely(seq_ptr != NULL)) {
@@ -148,8 +148,22 @@ struct __hart_internal {
     bool s_mode;
     uint32_t sie;
     uint32_t sip;
+    /* Set whenever sip, sie, sstatus.SIE or the privilege level changes in a
+     * way that may make an interrupt deliverable; the interpreter evaluates
+     * pending interrupts only while it is set. Code outside the core that
+     * raises a sip bit must set it as well.
+     */
+    bool irq_check;
 
     semu_timer_t time;
+    /* Cached rdtime state, maintained by vm_time_refresh() */
+    uint64_t time_base; /* host sample, never ahead of the host clock */
+    uint64_t time_base_instret;
+    uint64_t time_epoch; /* time.begin when time_base was sampled */
+    uint32_t time_rate;  /* ticks per instruction, 16.16 fixed point */
+    uint32_t time_span;  /* last host clock step, bounds interpolation */
+    bool time_cached;
+    bool time_idle; /* WFI executed since the last sample */
 
     /* Supervisor state */
     bool sstatus_spp;
@@ -185,6 +199,13 @@ struct __hart_internal {
     int32_t hsm_resume_pc;
     int32_t hsm_resume_opaque;
 
+    /* Adaptive slice sizing, maintained by the environment's scheduler:
+     * slice_shift is the current doubling of the baseline slice length and
+     * slice_activity records device activity since the last slice boundary.
+     */
+    uint8_t slice_shift;
+    bool slice_activity;
+
     /* Cold: set-associative caches */
     mmu_fetch_cache_t cache_fetch[16];
     mmu_cache_set_t cache_load[32];
@@ -232,3 +253,8 @@ void mmu_invalidate_range(hart_t *vm, uint32_t start_addr, uint32_t size);
 
 /* Invalidate instruction cache (FENCE.I) */
 void vm_fence_i(hart_t *vm);
+
+/* Resample the host clock backing the time/timeh CSRs. The environment calls
+ * this at slice boundaries; CSR reads in between are interpolated from instret.
+ */
+void vm_time_refresh(hart_t *vm);
@@ -0,0 +1,55 @@
+#!/usr/bin/env python3
+"""Convert a raw disk image into the compressed read-only format that
+virtio-blk detects by its magic (see "Compressed read-only images" in
+virtio-blk.c).
+
+Usage: compress-disk.py INPUT OUTPUT [CHUNK_KIB]
+"""
+
+import struct
+import sys
+import zlib
+
+MAGIC = b"SEMUCZ1\0"
+HEADER = struct.Struct("<8sIIQQ")
+
+
+def main(argv):
+    if len(argv) not in (3, 4):
+        sys.exit(__doc__.strip())
+    chunk_kib = int(argv[3]) if len(argv) == 4 else 64
+    chunk_bits = chunk_kib.bit_length() - 1 + 10
+    if chunk_kib & (chunk_kib - 1) or not 12 <= chunk_bits <= 24:
+        sys.exit("CHUNK_KIB must be a power of two between 4 and 16384")
+    chunk_size = 1 << chunk_bits
+
+    with open(argv[1], "rb") as src, open(argv[2], "wb") as dst:
+        dst.write(b"\0" * HEADER.size)
+        index = []
+        disk_size = 0
+        while True:
+            chunk = src.read(chunk_size)
+            if not chunk:
+                break
+            index.append(dst.tell())
+            packed = zlib.compress(chunk, 9)
+            # Chunks that do not shrink are stored as is
+            dst.write(packed if len(packed) < len(chunk) else chunk)
+            disk_size += len(chunk)
+        if not disk_size:
+            sys.exit(f"{argv[1]} is empty")
+        index.append(dst.tell())
+
+        # The index is read in place as an array of uint64_t
+        dst.write(b"\0" * (-dst.tell() % 8))
+        index_offset = dst.tell()
+        dst.write(struct.pack(f"<{len(index)}Q", *index))
+        dst.seek(0)
+        dst.write(HEADER.pack(MAGIC, chunk_bits, 0, disk_size, index_offset))
+
+    print(f"{argv[2]}: {disk_size} bytes in {len(index) - 1} chunks of "
+          f"{chunk_kib} KiB, {index_offset + 8 * len(index)} bytes stored")
+
+
+if __name__ == "__main__":
+    main(sys.argv)
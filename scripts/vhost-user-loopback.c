@@ -0,0 +1,409 @@
+/*
+ * Minimal vhost-user back-end for semu's virtio-net device
+ *
+ * Every frame the guest transmits is handed straight back to it on the
+ * receive queue, which makes this a peer for exercising "-n vhost-user"
+ * without a software switch:
+ *
+ *   make scripts/vhost-user-loopback
+ *   scripts/vhost-user-loopback /tmp/semu-vhost-user.sock &
+ *   ./semu ... -n vhost-user,path=/tmp/semu-vhost-user.sock
+ *
+ * Inside the guest, "ip -s link show eth0" then counts a received frame for
+ * each transmitted one. Frames that find no receive buffer are dropped. One
+ * front-end is served at a time, with split rings only.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "vhost-user.h"
+#include "virtio.h"
+
+#define RX 0
+#define TX 1
+#define FRAME_MAX (65536 + 12)
+
+#define FEATURES                                                    \
+    (VHOST_F_VERSION_1 | VHOST_USER_F_PROTOCOL_FEATURES |           \
+     (1ULL << 15) /* VIRTIO_NET_F_MRG_RXBUF */)
+
+typedef struct {
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[];
+} vring_avail_t;
+
+typedef struct {
+    uint16_t flags;
+    uint16_t idx;
+    struct {
+        uint32_t id;
+        uint32_t len;
+    } ring[];
+} vring_used_t;
+
+typedef struct {
+    uint32_t num;
+    struct virtq_desc *desc;
+    vring_avail_t *avail;
+    vring_used_t *used;
+    uint16_t last_avail;
+    int kick, call;
+    bool enabled, started;
+} vring_t;
+
+static struct {
+    uint8_t *map, *base; /* our mapping, and where the region starts in it */
+    uint64_t guest_addr, size, user_addr, mmap_offset;
+} region[VHOST_USER_MEM_REGIONS_MAX];
+static uint32_t nregions;
+static uint64_t features;
+static vring_t vring[2];
+static uint8_t frame[FRAME_MAX];
+
+static void unmap_regions(void)
+{
+    for (uint32_t i = 0; i < nregions; i++)
+        munmap(region[i].map, region[i].size + region[i].mmap_offset);
+    nregions = 0;
+}
+
+/* Translate a guest physical address (gpa) or a front-end one */
+static void *translate(uint64_t addr, uint64_t len, bool gpa)
+{
+    for (uint32_t i = 0; i < nregions; i++) {
+        uint64_t start = gpa ? region[i].guest_addr : region[i].user_addr;
+        if (addr >= start && addr - start + len <= region[i].size)
+            return region[i].base + (addr - start);
+    }
+    return NULL;
+}
+
+static void vring_reset(vring_t *vr)
+{
+    if (vr->kick >= 0)
+        close(vr->kick);
+    if (vr->call >= 0)
+        close(vr->call);
+    memset(vr, 0, sizeof(*vr));
+    vr->kick = vr->call = -1;
+}
+
+/* Walk a descriptor chain, copying readable buffers out of it (tx) or 'len'
+ * bytes of 'buf' into its writable buffers. Returns the bytes moved, or -1
+ * if the chain is malformed.
+ */
+static int vring_copy(vring_t *vr,
+                      uint16_t head,
+                      uint8_t *buf,
+                      int len,
+                      bool tx)
+{
+    int done = 0;
+    for (uint32_t i = head, n = 0; n < vr->num; n++) {
+        struct virtq_desc *d = &vr->desc[i];
+        bool writable = d->flags & VIRTIO_DESC_F_WRITE;
+        uint8_t *p = translate(d->addr, d->len, true);
+        if (!p || writable == tx || (d->flags & VIRTIO_DESC_F_INDIRECT))
+            return -1;
+        int chunk = d->len;
+        if (tx)
+            chunk = chunk < FRAME_MAX - done ? chunk : FRAME_MAX - done;
+        else
+            chunk = chunk < len - done ? chunk : len - done;
+        memcpy(tx ? buf + done : p, tx ? p : buf + done, chunk);
+        done += chunk;
+        if (!(d->flags & VIRTIO_DESC_F_NEXT) || (!tx && done == len))
+            return done;
+        i = d->next;
+        if (i >= vr->num)
+            return -1;
+    }
+    return -1;
+}
+
+static void vring_push(vring_t *vr, uint16_t head, uint32_t len)
+{
+    uint16_t idx = vr->used->idx;
+    vr->used->ring[idx % vr->num].id = head;
+    vr->used->ring[idx % vr->num].len = len;
+    __atomic_store_n(&vr->used->idx, idx + 1, __ATOMIC_RELEASE);
+}
+
+static void vring_call(vring_t *vr)
+{
+    uint64_t one = 1;
+    /* VIRTQ_AVAIL_F_NO_INTERRUPT */
+    if (vr->call >= 0 && !(vr->avail->flags & 1) &&
+        write(vr->call, &one, sizeof(one)) < 0)
+        perror("call");
+}
+
+static bool vring_ready(const vring_t *vr)
+{
+    return vr->started && vr->enabled && vr->desc;
+}
+
+/* Move every pending TX frame over to the RX ring */
+static void loop_frames(void)
+{
+    vring_t *tx = &vring[TX], *rx = &vring[RX];
+    bool tx_used = false, rx_used = false;
+    if (!vring_ready(tx))
+        return;
+
+    uint16_t avail;
+    while ((avail = __atomic_load_n(&tx->avail->idx, __ATOMIC_ACQUIRE)) !=
+           tx->last_avail) {
+        uint16_t head = tx->avail->ring[tx->last_avail % tx->num];
+        tx->last_avail++;
+        int len = vring_copy(tx, head, frame, 0, true);
+        vring_push(tx, head, 0);
+        tx_used = true;
+        if (len <= 12 || !vring_ready(rx) ||
+            __atomic_load_n(&rx->avail->idx, __ATOMIC_ACQUIRE) ==
+                rx->last_avail)
+            continue; /* nothing to deliver, or nowhere to put it */
+
+        /* The header goes back unchanged, but for num_buffers */
+        frame[10] = 1, frame[11] = 0;
+        uint16_t rx_head = rx->avail->ring[rx->last_avail % rx->num];
+        rx->last_avail++;
+        int n = vring_copy(rx, rx_head, frame, len, false);
+        vring_push(rx, rx_head, n < 0 ? 0 : n);
+        rx_used = true;
+    }
+    if (tx_used)
+        vring_call(tx);
+    if (rx_used)
+        vring_call(rx);
+}
+
+static int recv_msg(int fd, struct vhost_user_msg *msg, int *fds, int *nfds)
+{
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int) * VHOST_USER_MEM_REGIONS_MAX)];
+    } control;
+    struct iovec iov = {msg, VHOST_USER_HDR_SIZE};
+    struct msghdr mh = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+
+    *nfds = 0;
+    if (recvmsg(fd, &mh, MSG_CMSG_CLOEXEC) != VHOST_USER_HDR_SIZE)
+        return -1;
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&mh); c; c = CMSG_NXTHDR(&mh, c)) {
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+            *nfds = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(c), *nfds * sizeof(int));
+        }
+    }
+    if (msg->size > sizeof(msg->payload) ||
+        (msg->size &&
+         recv(fd, &msg->payload, msg->size, MSG_WAITALL) != msg->size))
+        return -1;
+    return 0;
+}
+
+static void reply_u64(int fd, struct vhost_user_msg *msg, uint64_t value)
+{
+    msg->flags = VHOST_USER_VERSION | VHOST_USER_REPLY;
+    msg->size = sizeof(msg->payload.u64);
+    msg->payload.u64 = value;
+    if (send(fd, msg, VHOST_USER_HDR_SIZE + msg->size, MSG_NOSIGNAL) < 0)
+        perror("send");
+}
+
+static void set_mem_table(const vhost_user_memory_t *mem,
+                          const int *fds,
+                          int nfds)
+{
+    unmap_regions();
+    for (uint32_t i = 0; i < mem->nregions && i < (uint32_t) nfds; i++) {
+        const vhost_user_mem_region_t *r = &mem->region[i];
+        uint8_t *base = mmap(NULL, r->size + r->mmap_offset,
+                             PROT_READ | PROT_WRITE, MAP_SHARED, fds[i], 0);
+        close(fds[i]);
+        if (base == MAP_FAILED) {
+            perror("mmap");
+            continue;
+        }
+        region[nregions].map = base;
+        region[nregions].base = base + r->mmap_offset;
+        region[nregions].mmap_offset = r->mmap_offset;
+        region[nregions].guest_addr = r->guest_addr;
+        region[nregions].size = r->size;
+        region[nregions].user_addr = r->user_addr;
+        nregions++;
+    }
+}
+
+/* Returns false once the front-end has gone away */
+static bool handle_msg(int fd)
+{
+    struct vhost_user_msg msg;
+    int fds[VHOST_USER_MEM_REGIONS_MAX], nfds;
+    if (recv_msg(fd, &msg, fds, &nfds) < 0)
+        return false;
+
+    uint32_t index = msg.payload.state.index;
+    vring_t *vr = &vring[(msg.payload.u64 & VHOST_USER_VRING_IDX_MASK) % 2];
+    switch (msg.request) {
+    case VHOST_USER_GET_FEATURES:
+        reply_u64(fd, &msg, FEATURES);
+        break;
+    case VHOST_USER_SET_FEATURES:
+        features = msg.payload.u64;
+        /* Without protocol features, rings run as soon as they are kicked */
+        for (int i = 0; i < 2; i++)
+            vring[i].enabled = !(features & VHOST_USER_F_PROTOCOL_FEATURES);
+        break;
+    case VHOST_USER_GET_PROTOCOL_FEATURES:
+        reply_u64(fd, &msg, 0);
+        break;
+    case VHOST_USER_SET_MEM_TABLE: {
+        vhost_user_memory_t mem;
+        memcpy(&mem, &msg.payload.memory, sizeof(mem));
+        set_mem_table(&mem, fds, nfds);
+        nfds = 0;
+        break;
+    }
+    case VHOST_USER_SET_VRING_NUM:
+        vring[index % 2].num = msg.payload.state.num;
+        break;
+    case VHOST_USER_SET_VRING_BASE:
+        vring[index % 2].last_avail = msg.payload.state.num;
+        break;
+    case VHOST_USER_SET_VRING_ADDR: {
+        vring_t *r = &vring[msg.payload.addr.index % 2];
+        uint64_t num = r->num;
+        r->desc = translate(msg.payload.addr.desc, num * 16, false);
+        r->avail = translate(msg.payload.addr.avail, 4 + num * 2, false);
+        r->used = translate(msg.payload.addr.used, 4 + num * 8, false);
+        if (!r->desc || !r->avail || !r->used)
+            r->desc = NULL;
+        break;
+    }
+    case VHOST_USER_GET_VRING_BASE:
+        /* Stop the ring and report where it stopped */
+        vring[index % 2].started = false;
+        msg.flags = VHOST_USER_VERSION | VHOST_USER_REPLY;
+        msg.payload.state.num = vring[index % 2].last_avail;
+        if (send(fd, &msg, VHOST_USER_HDR_SIZE + msg.size, MSG_NOSIGNAL) < 0)
+            perror("send");
+        break;
+    case VHOST_USER_SET_VRING_KICK:
+    case VHOST_USER_SET_VRING_CALL: {
+        int *slot = msg.request == VHOST_USER_SET_VRING_KICK ? &vr->kick
+                                                             : &vr->call;
+        if (*slot >= 0)
+            close(*slot);
+        *slot = -1;
+        if (!(msg.payload.u64 & VHOST_USER_VRING_NOFD) && nfds) {
+            *slot = fds[0];
+            nfds = 0;
+        }
+        /* A kick fd starts the ring */
+        if (msg.request == VHOST_USER_SET_VRING_KICK)
+            vr->started = true;
+        break;
+    }
+    case VHOST_USER_SET_VRING_ENABLE:
+        vring[index % 2].enabled = msg.payload.state.num;
+        break;
+    case VHOST_USER_SET_OWNER:
+    case VHOST_USER_SET_PROTOCOL_FEATURES:
+        break;
+    default:
+        fprintf(stderr, "vhost-user-loopback: ignoring request %u\n",
+                msg.request);
+        break;
+    }
+    for (int i = 0; i < nfds; i++)
+        close(fds[i]);
+    /* The ring may have been started with frames already pending */
+    loop_frames();
+    return true;
+}
+
+static void serve(int fd)
+{
+    for (int i = 0; i < 2; i++)
+        vring[i] = (vring_t) {.kick = -1, .call = -1};
+    for (;;) {
+        struct pollfd pfd[3] = {
+            {fd, POLLIN, 0},
+            {vring[RX].kick, POLLIN, 0},
+            {vring[TX].kick, POLLIN, 0},
+        };
+        if (poll(pfd, 3, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+        for (int i = 1; i < 3; i++) {
+            uint64_t kicks;
+            if ((pfd[i].revents & POLLIN) &&
+                read(pfd[i].fd, &kicks, sizeof(kicks)) < 0)
+                perror("kick");
+        }
+        if (pfd[1].revents || pfd[2].revents)
+            loop_frames();
+        if (pfd[0].revents && !handle_msg(fd))
+            break;
+    }
+    for (int i = 0; i < 2; i++)
+        vring_reset(&vring[i]);
+    unmap_regions();
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s socket-path\n", argv[0]);
+        return 2;
+    }
+
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(argv[1]) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "socket path too long: %s\n", argv[1]);
+        return 2;
+    }
+    strcpy(addr.sun_path, argv[1]);
+    int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(argv[1]);
+    if (lfd < 0 || bind(lfd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        listen(lfd, 1) < 0) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    for (;;) {
+        fprintf(stderr, "vhost-user-loopback: waiting on %s\n", argv[1]);
+        int fd = accept(lfd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("accept");
+            return 1;
+        }
+        fprintf(stderr, "vhost-user-loopback: front-end connected\n");
+        serve(fd);
+        close(fd);
+        fprintf(stderr, "vhost-user-loopback: front-end disconnected\n");
+    }
+}
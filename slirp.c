@@ -1,10 +1,13 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "netdev.h"
 
@@ -12,8 +15,18 @@
 static ssize_t net_slirp_send_packet(const void *buf, size_t len, void *opaque)
 {
     net_user_options_t *usr = (net_user_options_t *) opaque;
+    int active = __atomic_load_n(&usr->active_queues, __ATOMIC_RELAXED);
+    int q = active > 1 ? netdev_flow_hash(buf, len) % active : 0;
 
-    return write(usr->guest_to_host_channel[SLIRP_WRITE_SIDE], buf, len);
+    uint8_t *slot = slirp_ring_reserve(&usr->to_guest[q]);
+    if (!slot || len > SLIRP_SLOT_SIZE) {
+        /* Dropped, like a full socket buffer would; TCP recovers */
+        errno = ENOBUFS;
+        return -1;
+    }
+    memcpy(slot, buf, len);
+    slirp_ring_commit(&usr->to_guest[q], len);
+    return len;
 }
 
 /* Slirp callback: reports an error from the guest (current unused) */
@@ -22,12 +35,15 @@ static void net_slirp_guest_error(const char *msg UNUSED, void *opaque UNUSED)
     // Unused
 }
 
-/* Slirp callback: returns current time in nanoseconds for Slirp timers */
+/* Slirp callback: returns current time in nanoseconds for Slirp timers.
+ * This runs on the network thread, so it reads the host clock directly
+ * instead of the emulator's clocksource, which is not thread-safe.
+ */
 static int64_t net_slirp_clock_get_ns(void *opaque UNUSED)
 {
-    net_user_options_t *usr = (net_user_options_t *) opaque;
-
-    return semu_timer_get(&usr->timer->timer);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
 /* Slirp callback: called when Slirp has finished initialization */
@@ -37,18 +53,6 @@ static void net_slirp_init_completed(Slirp *slirp, void *opaque)
     s->slirp = slirp;
 }
 
-static void slirp_timer_init(slirp_timer *t, void (*cb)(void *opaque))
-{
-    t->cb = cb;
-    semu_timer_init(&t->timer, CLOCK_FREQ, 1);
-}
-
-static void net_slirp_timer_cb(void *opaque)
-{
-    slirp_timer *t = opaque;
-    slirp_handle_timer(t->slirp, t->id, t->cb_opaque);
-}
-
 /* Slirp callback: allocated and initializes a new timer object */
 static void *net_slirp_timer_new_opaque(SlirpTimerId id,
                                         void *cb_opaque,
@@ -56,30 +60,40 @@ static void *net_slirp_timer_new_opaque(SlirpTimerId id,
 {
     net_user_options_t *usr = (net_user_options_t *) opaque;
     slirp_timer *t = malloc(sizeof(slirp_timer));
-    usr->timer = t;
+    if (!t)
+        return NULL;
     t->slirp = usr->slirp;
     t->id = id;
     t->cb_opaque = cb_opaque;
     t->expire_timer_msec = -1;
-    slirp_timer_init(t, net_slirp_timer_cb);
+    t->next = usr->timers;
+    usr->timers = t;
 
     return t;
 }
 
 /* Slirp callback: releases resources associated with a timer */
-static void net_slirp_timer_free(void *timer, void *opaque UNUSED)
+static void net_slirp_timer_free(void *timer, void *opaque)
 {
-    if (timer)
-        free(timer);
+    net_user_options_t *usr = (net_user_options_t *) opaque;
+    for (slirp_timer **p = &usr->timers; *p; p = &(*p)->next) {
+        if (*p == timer) {
+            *p = ((slirp_timer *) timer)->next;
+            break;
+        }
+    }
+    free(timer);
 }
 
-/* Slirp callback: modifies the expiration time of an existing timer */
+/* Slirp callback: modifies the expiration time of an existing timer. The
+ * expiry is absolute, in milliseconds of the clock_get_ns() timebase.
+ */
 static void net_slirp_timer_mod(void *timer,
                                 int64_t expire_time,
                                 void *opaque UNUSED)
 {
     slirp_timer *t = (slirp_timer *) timer;
-    semu_timer_rebase(&t->timer, expire_time);
+    t->expire_timer_msec = expire_time;
 }
 
 /* Slirp callback: registers a pollable socket (unused in this backend) */
@@ -94,10 +108,21 @@ static void net_slirp_unregister_poll_sock(int fd UNUSED, void *opaque UNUSED)
     // Unused
 }
 
-/* Slirp callback: notifies backend of pending activity (unused) */
-static void net_slirp_notify(void *opaque UNUSED)
+/* Wake the network thread out of poll(). Kicks are coalesced: only the
+ * first one since the thread last looked at the flag writes a byte.
+ */
+static void net_slirp_wake(net_user_options_t *usr)
 {
-    // Unused
+    if (!__atomic_exchange_n(&usr->kicked, true, __ATOMIC_ACQ_REL)) {
+        ssize_t n = write(usr->wake_fd[1], "", 1);
+        (void) n;
+    }
+}
+
+/* Slirp callback: notifies backend of pending activity */
+static void net_slirp_notify(void *opaque)
+{
+    net_slirp_wake((net_user_options_t *) opaque);
 }
 
 static const SlirpCb slirp_cb = {
@@ -157,20 +182,180 @@ int semu_slirp_add_poll_socket(slirp_os_socket fd, int events, void *opaque)
     }
 }
 
-int net_slirp_read(net_user_options_t *usr)
+uint8_t *slirp_ring_reserve(slirp_ring_t *ring)
 {
-    uint8_t pkt[SLIRP_PKT_MAX];
-    ssize_t plen =
-        recv(usr->host_to_guest_channel[SLIRP_READ_SIDE], pkt, sizeof(pkt), 0);
-    if (plen < 0) {
-        if (errno == EAGAIN || errno == EWOULDBLOCK)
-            return 0;
-        fprintf(stderr, "[SLIRP] failed to read packet from virtio-net: %s\n",
-                strerror(errno));
-        return -1;
+    uint32_t head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) ==
+        SLIRP_RING_SLOTS)
+        return NULL;
+    return ring->slot[head % SLIRP_RING_SLOTS];
+}
+
+void slirp_ring_commit(slirp_ring_t *ring, size_t len)
+{
+    ring->len[ring->head % SLIRP_RING_SLOTS] = len;
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+const uint8_t *slirp_ring_peek(slirp_ring_t *ring, size_t *len)
+{
+    uint32_t tail = ring->tail;
+    if (tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+        return NULL;
+    *len = ring->len[tail % SLIRP_RING_SLOTS];
+    return ring->slot[tail % SLIRP_RING_SLOTS];
+}
+
+void slirp_ring_release(slirp_ring_t *ring)
+{
+    __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+}
+
+bool slirp_ring_empty(slirp_ring_t *ring)
+{
+    return ring->tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+}
+
+static bool slirp_ring_init(slirp_ring_t *ring)
+{
+    ring->head = ring->tail = 0;
+    ring->slot = malloc(SLIRP_RING_SLOTS * sizeof(*ring->slot));
+    return ring->slot;
+}
+
+/* Feed every frame the guest has queued to slirp, straight from the ring.
+ * Runs on the network thread only.
+ */
+static void net_slirp_input(net_user_options_t *usr)
+{
+    const uint8_t *frame;
+    size_t len;
+    while ((frame = slirp_ring_peek(&usr->to_slirp, &len))) {
+        slirp_input(usr->slirp, frame, len);
+        slirp_ring_release(&usr->to_slirp);
+    }
+}
+
+/* Tell the network thread that the guest has queued frames on to_slirp */
+void net_slirp_kick(net_user_options_t *usr)
+{
+    net_slirp_wake(usr);
+}
+
+/* Acknowledge a notification from the network thread. Returns true if one
+ * was pending, i.e. slirp has queued frames since the last call.
+ *
+ * The pipe is drained unconditionally and before the flag is cleared: a
+ * notification raced in between leaves at most a stray byte behind, which
+ * costs one spurious wakeup, whereas a flag left set would suppress every
+ * later one.
+ */
+bool net_slirp_rx_ack(net_user_options_t *usr)
+{
+    char buf[16];
+    while (read(usr->notify_fd[0], buf, sizeof(buf)) > 0)
+        ;
+    return __atomic_exchange_n(&usr->rx_notified, false, __ATOMIC_ACQ_REL);
+}
+
+int net_slirp_notify_fd(net_user_options_t *usr)
+{
+    return usr->notify_fd[0];
+}
+
+/* Fire expired timers and return the milliseconds until the next one, or
+ * UINT32_MAX if none is armed.
+ */
+static uint32_t net_slirp_run_timers(net_user_options_t *usr)
+{
+    int64_t now = net_slirp_clock_get_ns(usr) / 1000000;
+    uint32_t timeout = UINT32_MAX;
+    slirp_timer *t = usr->timers;
+    while (t) {
+        /* The handler may free or re-arm this timer */
+        slirp_timer *next = t->next;
+        if (t->expire_timer_msec >= 0 && t->expire_timer_msec <= now) {
+            t->expire_timer_msec = -1;
+            slirp_handle_timer(usr->slirp, t->id, t->cb_opaque);
+        }
+        t = next;
+    }
+    for (t = usr->timers; t; t = t->next) {
+        if (t->expire_timer_msec >= 0)
+            timeout = MIN(timeout, (uint32_t) (t->expire_timer_msec - now));
+    }
+    return timeout;
+}
+
+/* Let the emulator know if slirp has queued frames for the guest since the
+ * last call. 'heads' tracks the ring heads already announced.
+ */
+static void net_slirp_notify_rx(net_user_options_t *usr, uint32_t *heads)
+{
+    bool produced = false;
+    for (int q = 0; q < usr->queues; q++) {
+        if (usr->to_guest[q].head != heads[q])
+            produced = true;
+        heads[q] = usr->to_guest[q].head;
+    }
+    if (produced &&
+        !__atomic_exchange_n(&usr->rx_notified, true, __ATOMIC_ACQ_REL)) {
+        ssize_t n = write(usr->notify_fd[1], "", 1);
+        (void) n;
     }
-    slirp_input(usr->slirp, pkt, plen);
-    return plen;
+}
+
+/* Network thread event loop. It owns the Slirp instance: the emulator thread
+ * only touches the rings, and the two sides wake each other through pipes.
+ */
+static void *net_slirp_thread(void *arg)
+{
+    net_user_options_t *usr = arg;
+    uint32_t heads[NETDEV_QUEUES_MAX] = {0};
+
+    for (;;) {
+        /* Clear the kick flag before draining so that a frame queued after
+         * the drain is guaranteed to write a fresh wake byte.
+         */
+        __atomic_store_n(&usr->kicked, false, __ATOMIC_RELEASE);
+        net_slirp_input(usr);
+        uint32_t timeout = net_slirp_run_timers(usr);
+
+        /* Replies to the frames just fed in, and anything produced by the
+         * previous poll, must be announced before blocking again.
+         */
+        net_slirp_notify_rx(usr, heads);
+
+        usr->pfd_len = 1;
+        usr->pfd[0] = (struct pollfd) {usr->wake_fd[0], POLLIN, 0};
+        slirp_pollfds_fill_socket(usr->slirp, &timeout,
+                                  semu_slirp_add_poll_socket, usr);
+
+        int ret = poll(usr->pfd, usr->pfd_len,
+                       timeout == UINT32_MAX ? -1 : (int) timeout);
+        if (ret < 0 && errno != EINTR) {
+            perror("slirp: poll");
+            break;
+        }
+        if (ret > 0 && (usr->pfd[0].revents & POLLIN)) {
+            char buf[16];
+            while (read(usr->wake_fd[0], buf, sizeof(buf)) > 0)
+                ;
+        }
+        slirp_pollfds_poll(usr->slirp, ret <= 0, semu_slirp_get_revents, usr);
+    }
+    return NULL;
+}
+
+static bool net_slirp_pipe(int fd[2])
+{
+    if (pipe(fd) < 0) {
+        perror("slirp: pipe");
+        return false;
+    }
+    for (int i = 0; i < 2; i++)
+        fcntl(fd[i], F_SETFL, fcntl(fd[i], F_GETFL, 0) | O_NONBLOCK);
+    return true;
 }
 
 Slirp *slirp_create(net_user_options_t *usr, SlirpConfig *cfg)
@@ -212,37 +397,26 @@ int net_slirp_init(net_user_options_t *usr)
     usr->slirp = slirp_create(usr, &cfg);
     if (usr->slirp == NULL) {
         fprintf(stderr, "create slirp failed\n");
+        return -1;
     }
 
-    if (socketpair(AF_UNIX, SOCK_DGRAM, 0, usr->guest_to_host_channel) < 0)
+    for (int q = 0; q < usr->queues; q++) {
+        if (!slirp_ring_init(&usr->to_guest[q]))
+            return -1;
+    }
+    if (!slirp_ring_init(&usr->to_slirp))
         return -1;
-    assert(
-        fcntl(usr->guest_to_host_channel[SLIRP_READ_SIDE], F_SETFL,
-              fcntl(usr->guest_to_host_channel[SLIRP_READ_SIDE], F_GETFL, 0) |
-                  O_NONBLOCK) >= 0);
-    assert(
-        fcntl(usr->guest_to_host_channel[SLIRP_WRITE_SIDE], F_SETFL,
-              fcntl(usr->guest_to_host_channel[SLIRP_WRITE_SIDE], F_GETFL, 0) |
-                  O_NONBLOCK) >= 0);
-
-    if (socketpair(AF_UNIX, SOCK_DGRAM, 0, usr->host_to_guest_channel) < 0)
+
+    if (!net_slirp_pipe(usr->wake_fd) || !net_slirp_pipe(usr->notify_fd))
         return -1;
-    assert(
-        fcntl(usr->host_to_guest_channel[SLIRP_READ_SIDE], F_SETFL,
-              fcntl(usr->host_to_guest_channel[SLIRP_READ_SIDE], F_GETFL, 0) |
-                  O_NONBLOCK) >= 0);
-    assert(
-        fcntl(usr->host_to_guest_channel[SLIRP_WRITE_SIDE], F_SETFL,
-              fcntl(usr->host_to_guest_channel[SLIRP_WRITE_SIDE], F_GETFL, 0) |
-                  O_NONBLOCK) >= 0);
-
-    /* Register the read end of the internal pipe (channel[SLIRP_READ_SIDE])
-     * with slirp's poll system. This allows slirp to monitor it for incoming
-     * data (POLL_IN) or hang-up event (POLL_HUP).
-     */
-    semu_slirp_add_poll_socket(usr->guest_to_host_channel[SLIRP_READ_SIDE],
-                               SLIRP_POLL_IN | SLIRP_POLL_HUP, usr);
-    semu_slirp_add_poll_socket(usr->host_to_guest_channel[SLIRP_READ_SIDE],
-                               SLIRP_POLL_IN | SLIRP_POLL_HUP, usr);
+    /* Slot 0 is reserved for the wake pipe */
+    usr->pfd_size = 16;
+    usr->pfd = malloc(usr->pfd_size * sizeof(struct pollfd));
+    if (!usr->pfd)
+        return -1;
+    if (pthread_create(&usr->thread, NULL, net_slirp_thread, usr) != 0) {
+        fprintf(stderr, "slirp: failed to start network thread\n");
+        return -1;
+    }
     return 0;
 }
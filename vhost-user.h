@@ -0,0 +1,82 @@
+#pragma once
+
+#include <stdint.h>
+
+/* vhost-user protocol, front-end ("master") and back-end message formats.
+ * Only the requests needed to hand a virtio-net queue pair to a back-end
+ * are listed. See
+ * https://qemu-project.gitlab.io/qemu/interop/vhost-user.html
+ */
+
+#define VHOST_USER_GET_FEATURES 1
+#define VHOST_USER_SET_FEATURES 2
+#define VHOST_USER_SET_OWNER 3
+#define VHOST_USER_SET_MEM_TABLE 5
+#define VHOST_USER_SET_VRING_NUM 8
+#define VHOST_USER_SET_VRING_ADDR 9
+#define VHOST_USER_SET_VRING_BASE 10
+#define VHOST_USER_GET_VRING_BASE 11
+#define VHOST_USER_SET_VRING_KICK 12
+#define VHOST_USER_SET_VRING_CALL 13
+#define VHOST_USER_GET_PROTOCOL_FEATURES 15
+#define VHOST_USER_SET_PROTOCOL_FEATURES 16
+#define VHOST_USER_SET_VRING_ENABLE 18
+
+/* Header flags */
+#define VHOST_USER_VERSION 0x1
+#define VHOST_USER_VERSION_MASK 0x3
+#define VHOST_USER_REPLY (1 << 2)
+#define VHOST_USER_NEED_REPLY (1 << 3)
+
+/* Rings start disabled once this has been negotiated */
+#define VHOST_USER_F_PROTOCOL_FEATURES (1ULL << 30)
+#define VHOST_F_VERSION_1 (1ULL << 32)
+
+/* SET_VRING_KICK/CALL payload: ring index, and this bit when no fd is sent */
+#define VHOST_USER_VRING_IDX_MASK 0xFF
+#define VHOST_USER_VRING_NOFD (1 << 8)
+
+#define VHOST_USER_MEM_REGIONS_MAX 8
+
+typedef struct {
+    uint32_t index;
+    uint32_t num;
+} vhost_user_vring_state_t;
+
+typedef struct {
+    uint32_t index;
+    uint32_t flags;
+    /* front-end virtual addresses, translated through the memory table */
+    uint64_t desc;
+    uint64_t used;
+    uint64_t avail;
+    uint64_t log;
+} vhost_user_vring_addr_t;
+
+typedef struct {
+    uint64_t guest_addr;
+    uint64_t size;
+    uint64_t user_addr; /* where the front-end maps it */
+    uint64_t mmap_offset;
+} vhost_user_mem_region_t;
+
+typedef struct {
+    uint32_t nregions;
+    uint32_t padding;
+    vhost_user_mem_region_t region[VHOST_USER_MEM_REGIONS_MAX];
+} vhost_user_memory_t;
+
+/* The payload follows the 12-byte header without padding */
+PACKED(struct vhost_user_msg {
+    uint32_t request;
+    uint32_t flags;
+    uint32_t size; /* of the payload that follows */
+    union {
+        uint64_t u64;
+        vhost_user_vring_state_t state;
+        vhost_user_vring_addr_t addr;
+        vhost_user_memory_t memory;
+    } payload;
+});
+
+#define VHOST_USER_HDR_SIZE 12
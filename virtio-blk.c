@@ -1,27 +1,46 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
+#if SEMU_HAS(VBLK_COMPRESS)
+#include <zlib.h>
+#endif
 
 #include "common.h"
 #include "device.h"
 #include "riscv.h"
 #include "riscv_private.h"
+#include "utils.h"
 #include "virtio.h"
 
 #define DISK_BLK_SIZE 512
 
-#define VBLK_DEV_CNT_MAX 1
-
-#define VBLK_FEATURES_0 0
+#define VBLK_FEATURES_0                                            \
+    (VIRTIO_BLK_F_SIZE_MAX | VIRTIO_BLK_F_SEG_MAX | VIRTIO_BLK_F_FLUSH | \
+     VIRTIO_BLK_F_MQ | VIRTIO_BLK_F_DISCARD | VIRTIO_BLK_F_WRITE_ZEROES | \
+     VIRTIO_RING_F_INDIRECT_DESC | VIRTIO_RING_F_EVENT_IDX)
 #define VBLK_FEATURES_1 1 /* VIRTIO_F_VERSION_1 */
 #define VBLK_QUEUE_NUM_MAX 1024
+
+/* Largest request accepted: VBLK_SEG_MAX data segments (plus the header and
+ * status descriptors) of at most VBLK_SIZE_MAX bytes each.
+ */
+#define VBLK_SEG_MAX 126
+#define VBLK_SIZE_MAX (1U << 20)
+
+/* Limits advertised for DISCARD and WRITE_ZEROES */
+#define VBLK_DWZ_SECTORS_MAX (1U << 22) /* 2 GiB per segment */
+#define VBLK_DWZ_SEG_MAX 32
 #define VBLK_QUEUE (vblk->queues[vblk->QueueSel])
 
 #define PRIV(x) ((struct virtio_blk_config *) x->priv)
@@ -47,7 +66,8 @@ PACKED(struct virtio_blk_config {
     } topology;
 
     uint8_t writeback;
-    uint8_t unused0[3];
+    uint8_t unused0;
+    uint16_t num_queues;
     uint32_t max_discard_sectors;
     uint32_t max_discard_seg;
     uint32_t discard_sector_alignment;
@@ -64,14 +84,21 @@ PACKED(struct vblk_req_header {
     uint8_t status;
 });
 
+/* Payload segment of DISCARD and WRITE_ZEROES requests */
+PACKED(struct vblk_discard_write_zeroes {
+    uint64_t sector;
+    uint32_t num_sectors;
+    uint32_t flags;
+});
+
 static struct virtio_blk_config vblk_configs[VBLK_DEV_CNT_MAX];
 static int vblk_dev_cnt = 0;
 
 /* Track each MAP_SHARED disk mapping so we can msync(MS_SYNC) on graceful
  * exit. Without this, dirty pages live in the host page cache and rely on
- * the kernel's writeback to land on disk. The guest cannot trigger a sync
- * via VIRTIO_BLK_T_FLUSH today because we do not advertise
- * VIRTIO_BLK_F_FLUSH; this hook is the best-effort substitute for that.
+ * the kernel's writeback to land on disk. The guest requests durability
+ * points itself through VIRTIO_BLK_T_FLUSH; this hook covers whatever was
+ * written after the last flush.
  */
 static struct {
     void *addr;
@@ -79,8 +106,21 @@ static struct {
 } vblk_disks[VBLK_DEV_CNT_MAX];
 static int vblk_disks_cnt = 0;
 
+/* Devices exposed with VIRTIO_BLK_F_RO; writes to them fail */
+static bool vblk_read_only[VBLK_DEV_CNT_MAX];
+
+/* Index of "vblk" in the per-device tables */
+static inline int vblk_index(const virtio_blk_state_t *vblk)
+{
+    return (struct virtio_blk_config *) vblk->priv - vblk_configs;
+}
+
+static void virtio_blk_aio_stop_all(void);
+
 static void virtio_blk_sync_all(void)
 {
+    /* No worker may still be copying a write into a mapping being synced */
+    virtio_blk_aio_stop_all();
     for (int i = 0; i < vblk_disks_cnt; i++) {
         if (!vblk_disks[i].addr)
             continue;
@@ -104,131 +144,1222 @@ static inline uint32_t vblk_preprocess(virtio_blk_state_t *vblk, uint32_t addr)
     return addr >> 2;
 }
 
-static void virtio_blk_update_status(virtio_blk_state_t *vblk, uint32_t status)
+/* Copy-on-write overlay (-d base.img,overlay=FILE)
+ *
+ * The base image is mapped read-only and may be shared by any number of
+ * guests. Writes land in a per-guest overlay file laid out as
+ *
+ *   header | allocation bitmap (one bit per cluster) | data clusters
+ *
+ * where the data area mirrors the base image offset for offset. The file is
+ * extended with ftruncate() and stays sparse, so only clusters the guest has
+ * written consume host disk space, and no remapping table is needed. A
+ * cluster is read from the overlay once its bit is set and from the base
+ * otherwise. The first partial write to a cluster copies the base contents
+ * up before its bit is published.
+ */
+#define VBLK_COW_MAGIC "SEMUCOW"
+#define VBLK_COW_VERSION 1
+#define VBLK_COW_CLUSTER_BITS 16 /* 64 KiB */
+
+PACKED(struct vblk_cow_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t cluster_bits;
+    uint64_t disk_size;
+    uint64_t bitmap_offset;
+    uint64_t data_offset;
+});
+
+static struct vblk_cow {
+    bool enabled;
+    uint32_t cluster_bits;
+    uint64_t disk_size;
+    uint8_t *bitmap;
+    uint8_t *data;
+    pthread_mutex_t lock; /* serializes cluster allocation */
+} vblk_cow[VBLK_DEV_CNT_MAX];
+
+static inline struct vblk_cow *vblk_cow_of(const virtio_blk_state_t *vblk)
 {
-    vblk->Status |= status;
-    if (status)
-        return;
+    return &vblk_cow[vblk_index(vblk)];
+}
 
-    /* Reset */
-    uint32_t *ram = vblk->ram;
-    uint32_t *disk = vblk->disk;
-    void *priv = vblk->priv;
-    uint32_t capacity = PRIV(vblk)->capacity;
-    memset(vblk, 0, sizeof(*vblk));
-    vblk->ram = ram;
-    vblk->disk = disk;
-    vblk->priv = priv;
-    PRIV(vblk)->capacity = capacity;
+static inline bool vblk_cow_allocated(const struct vblk_cow *cow,
+                                      uint64_t cluster)
+{
+    return __atomic_load_n(&cow->bitmap[cluster >> 3], __ATOMIC_ACQUIRE) &
+           (1U << (cluster & 7));
+}
+
+/* Give "cluster" its own copy in the overlay. When the caller is about to
+ * overwrite the whole cluster, the copy-up from the base is skipped.
+ */
+static void vblk_cow_alloc(struct vblk_cow *cow,
+                           const uint8_t *base,
+                           uint64_t cluster,
+                           bool whole)
+{
+    pthread_mutex_lock(&cow->lock);
+    if (!vblk_cow_allocated(cow, cluster)) {
+        uint64_t start = cluster << cow->cluster_bits;
+        if (!whole) {
+            uint64_t size = MIN((uint64_t) 1 << cow->cluster_bits,
+                                cow->disk_size - start);
+            memcpy(cow->data + start, base + start, size);
+        }
+        __atomic_fetch_or(&cow->bitmap[cluster >> 3], 1U << (cluster & 7),
+                          __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&cow->lock);
+}
+
+static void vblk_cow_read(struct vblk_cow *cow,
+                          const uint8_t *base,
+                          uint64_t offset,
+                          uint8_t *dest,
+                          uint64_t len)
+{
+    uint64_t cluster_size = (uint64_t) 1 << cow->cluster_bits;
+
+    while (len) {
+        uint64_t cluster = offset >> cow->cluster_bits;
+        uint64_t chunk =
+            MIN(len, cluster_size - (offset & (cluster_size - 1)));
+        const uint8_t *src =
+            vblk_cow_allocated(cow, cluster) ? cow->data : base;
+        memcpy(dest, src + offset, chunk);
+        offset += chunk;
+        dest += chunk;
+        len -= chunk;
+    }
+}
+
+/* Write "len" bytes from "src", or zeroes if "src" is NULL */
+static void vblk_cow_write(struct vblk_cow *cow,
+                           const uint8_t *base,
+                           uint64_t offset,
+                           const uint8_t *src,
+                           uint64_t len)
+{
+    uint64_t cluster_size = (uint64_t) 1 << cow->cluster_bits;
+
+    while (len) {
+        uint64_t cluster = offset >> cow->cluster_bits;
+        uint64_t chunk =
+            MIN(len, cluster_size - (offset & (cluster_size - 1)));
+        if (!vblk_cow_allocated(cow, cluster))
+            vblk_cow_alloc(cow, base, cluster, chunk == cluster_size);
+        if (src) {
+            memcpy(cow->data + offset, src, chunk);
+            src += chunk;
+        } else {
+            memset(cow->data + offset, 0, chunk);
+        }
+        offset += chunk;
+        len -= chunk;
+    }
+}
+
+/* Open or create the overlay for a base image of "disk_size" bytes and map
+ * it. Returns the mapping (to be synced like a disk) or NULL on error.
+ */
+static void *vblk_cow_open(struct vblk_cow *cow,
+                           const char *path,
+                           uint64_t disk_size,
+                           size_t *map_size)
+{
+    uint64_t page = (uint64_t) sysconf(_SC_PAGESIZE);
+    uint64_t cluster_size = (uint64_t) 1 << VBLK_COW_CLUSTER_BITS;
+    uint64_t n_clusters = (disk_size + cluster_size - 1) / cluster_size;
+    struct vblk_cow_header hdr;
+
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "could not open overlay %s: %s\n", path,
+                strerror(errno));
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        fprintf(stderr, "fstat(%s): %s\n", path, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    if (st.st_size == 0) {
+        /* Fresh overlay: everything still reads from the base */
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, VBLK_COW_MAGIC, sizeof(VBLK_COW_MAGIC));
+        hdr.version = VBLK_COW_VERSION;
+        hdr.cluster_bits = VBLK_COW_CLUSTER_BITS;
+        hdr.disk_size = disk_size;
+        hdr.bitmap_offset = page;
+        hdr.data_offset = (page + (n_clusters + 7) / 8 + cluster_size - 1) &
+                          ~(cluster_size - 1);
+        if (pwrite(fd, &hdr, sizeof(hdr), 0) != (ssize_t) sizeof(hdr) ||
+            ftruncate(fd, hdr.data_offset + n_clusters * cluster_size) < 0) {
+            fprintf(stderr, "could not initialize overlay %s: %s\n", path,
+                    strerror(errno));
+            close(fd);
+            return NULL;
+        }
+    } else if (pread(fd, &hdr, sizeof(hdr), 0) != (ssize_t) sizeof(hdr) ||
+               memcmp(hdr.magic, VBLK_COW_MAGIC, sizeof(VBLK_COW_MAGIC)) ||
+               hdr.version != VBLK_COW_VERSION ||
+               hdr.cluster_bits < 12 || hdr.cluster_bits > 24 ||
+               hdr.bitmap_offset < sizeof(hdr)) {
+        fprintf(stderr, "%s is not a semu overlay\n", path);
+        close(fd);
+        return NULL;
+    } else if (hdr.disk_size != disk_size) {
+        fprintf(stderr,
+                "overlay %s was created for a %" PRIu64
+                "-byte base image, not %" PRIu64 " bytes\n",
+                path, hdr.disk_size, disk_size);
+        close(fd);
+        return NULL;
+    }
+
+    cluster_size = (uint64_t) 1 << hdr.cluster_bits;
+    n_clusters = (disk_size + cluster_size - 1) / cluster_size;
+    uint64_t size = hdr.data_offset + n_clusters * cluster_size;
+    if (hdr.data_offset < hdr.bitmap_offset + (n_clusters + 7) / 8 ||
+        (uint64_t) st.st_size > size) {
+        fprintf(stderr, "overlay %s is corrupted\n", path);
+        close(fd);
+        return NULL;
+    }
+    /* An overlay truncated by a crash is extended back with zero clusters */
+    if ((uint64_t) st.st_size < size && ftruncate(fd, size) < 0) {
+        fprintf(stderr, "ftruncate(%s): %s\n", path, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    uint8_t *map =
+        mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Could not map overlay %s\n", path);
+        return NULL;
+    }
+
+    cow->cluster_bits = hdr.cluster_bits;
+    cow->disk_size = disk_size;
+    cow->bitmap = map + hdr.bitmap_offset;
+    cow->data = map + hdr.data_offset;
+    pthread_mutex_init(&cow->lock, NULL);
+    cow->enabled = true;
+    *map_size = size;
+    return map;
+}
+
+/* Compressed read-only images
+ *
+ * scripts/compress-disk.py turns a raw image into
+ *
+ *   header | chunk 0 | chunk 1 | ... | index
+ *
+ * where every chunk covers (1 << chunk_bits) bytes of the disk and is stored
+ * as a zlib stream, or raw when compression does not pay off (its stored
+ * length then equals its disk length). The index holds n_chunks + 1 file
+ * offsets, so chunk i is [index[i], index[i + 1]). Such images are detected
+ * by their magic, exposed with VIRTIO_BLK_F_RO, and decompressed on demand
+ * into an LRU cache whose size is set with "cache=SIZE".
+ */
+#define VBLK_CZ_MAGIC "SEMUCZ1"
+#define VBLK_CZ_CACHE_DEFAULT (16U << 20)
+
+PACKED(struct vblk_cz_header {
+    char magic[8];
+    uint32_t chunk_bits;
+    uint32_t reserved;
+    uint64_t disk_size;
+    uint64_t index_offset;
+});
+
+static bool vblk_cz_probe(int fd)
+{
+    char magic[8];
+    return pread(fd, magic, sizeof(magic), 0) == (ssize_t) sizeof(magic) &&
+           !memcmp(magic, VBLK_CZ_MAGIC, sizeof(VBLK_CZ_MAGIC));
+}
+
+#if SEMU_HAS(VBLK_COMPRESS)
+typedef struct {
+    struct list_head lru;
+    int64_t chunk; /* -1 while empty */
+    uint8_t *data;
+} vblk_cz_entry_t;
+
+static struct vblk_cz {
+    bool enabled;
+    uint32_t chunk_bits;
+    uint64_t disk_size;
+    uint64_t n_chunks;
+    const uint8_t *file;
+    const uint64_t *index;
+    vblk_cz_entry_t *entries;
+    int32_t *slot;         /* chunk -> cache entry, or -1 */
+    struct list_head lru;  /* least recently used first */
+    pthread_mutex_t lock;  /* protects the cache */
+} vblk_cz[VBLK_DEV_CNT_MAX];
+
+static inline struct vblk_cz *vblk_cz_of(const virtio_blk_state_t *vblk)
+{
+    return &vblk_cz[vblk_index(vblk)];
+}
+
+/* Return the decompressed contents of "chunk", or NULL if it is corrupted.
+ * Called with cz->lock held.
+ */
+static const uint8_t *vblk_cz_chunk(struct vblk_cz *cz, uint64_t chunk)
+{
+    vblk_cz_entry_t *entry;
+
+    if (cz->slot[chunk] >= 0) {
+        entry = &cz->entries[cz->slot[chunk]];
+        list_del(&entry->lru);
+        list_push(&entry->lru, &cz->lru);
+        return entry->data;
+    }
+
+    /* Evict the least recently used entry */
+    entry = list_first_entry(&cz->lru, vblk_cz_entry_t, lru);
+    if (entry->chunk >= 0)
+        cz->slot[entry->chunk] = -1;
+    entry->chunk = -1;
+
+    uint64_t start = chunk << cz->chunk_bits;
+    uLongf size = MIN((uint64_t) 1 << cz->chunk_bits, cz->disk_size - start);
+    uLongf out = size;
+    const uint8_t *src = cz->file + cz->index[chunk];
+    uLong src_len = cz->index[chunk + 1] - cz->index[chunk];
+    if (src_len == size) {
+        memcpy(entry->data, src, size);
+    } else if (uncompress(entry->data, &out, src, src_len) != Z_OK ||
+               out != size) {
+        fprintf(stderr, "virtio-blk: corrupted compressed chunk %" PRIu64 "\n",
+                chunk);
+        return NULL;
+    }
+
+    entry->chunk = chunk;
+    cz->slot[chunk] = entry - cz->entries;
+    list_del(&entry->lru);
+    list_push(&entry->lru, &cz->lru);
+    return entry->data;
+}
+
+static bool vblk_cz_read(struct vblk_cz *cz,
+                         uint64_t offset,
+                         uint8_t *dest,
+                         uint64_t len)
+{
+    uint64_t chunk_size = (uint64_t) 1 << cz->chunk_bits;
+    bool ok = true;
+
+    pthread_mutex_lock(&cz->lock);
+    while (len) {
+        uint64_t chunk = offset >> cz->chunk_bits;
+        uint64_t in = offset & (chunk_size - 1);
+        uint64_t n = MIN(len, chunk_size - in);
+        const uint8_t *data = vblk_cz_chunk(cz, chunk);
+        if (!data) {
+            ok = false;
+            break;
+        }
+        memcpy(dest, data + in, n);
+        offset += n;
+        dest += n;
+        len -= n;
+    }
+    pthread_mutex_unlock(&cz->lock);
+    return ok;
 }
 
+/* Map the compressed image open on "fd" and set up a cache of about
+ * "cache_size" bytes. Returns false on a malformed image.
+ */
+static bool vblk_cz_open(struct vblk_cz *cz,
+                         int fd,
+                         uint64_t file_size,
+                         uint64_t cache_size)
+{
+    struct vblk_cz_header hdr;
+
+    if (pread(fd, &hdr, sizeof(hdr), 0) != (ssize_t) sizeof(hdr) ||
+        hdr.chunk_bits < 12 || hdr.chunk_bits > 24 || !hdr.disk_size ||
+        hdr.index_offset % sizeof(uint64_t) ||
+        hdr.index_offset < sizeof(hdr) || hdr.index_offset > file_size)
+        return false;
+    cz->chunk_bits = hdr.chunk_bits;
+    cz->disk_size = hdr.disk_size;
+    cz->n_chunks = (hdr.disk_size + ((uint64_t) 1 << hdr.chunk_bits) - 1) >>
+                   hdr.chunk_bits;
+    if ((file_size - hdr.index_offset) / sizeof(uint64_t) < cz->n_chunks + 1)
+        return false;
+
+    void *file = mmap(NULL, file_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (file == MAP_FAILED)
+        return false;
+    cz->file = file;
+    cz->index = (const uint64_t *) (cz->file + hdr.index_offset);
+    for (uint64_t i = 0; i < cz->n_chunks; i++) {
+        if (cz->index[i] < sizeof(hdr) || cz->index[i] > cz->index[i + 1] ||
+            cz->index[i + 1] > hdr.index_offset) {
+            munmap(file, file_size);
+            return false;
+        }
+    }
+
+    uint64_t n_entries = MIN(cache_size >> cz->chunk_bits, cz->n_chunks);
+    if (!n_entries)
+        n_entries = 1;
+    cz->entries = calloc(n_entries, sizeof(*cz->entries));
+    cz->slot = malloc(cz->n_chunks * sizeof(*cz->slot));
+    if (!cz->entries || !cz->slot) {
+        fprintf(stderr, "virtio-blk: out of memory\n");
+        exit(2);
+    }
+    memset(cz->slot, 0xff, cz->n_chunks * sizeof(*cz->slot));
+    INIT_LIST_HEAD(&cz->lru);
+    for (uint64_t i = 0; i < n_entries; i++) {
+        cz->entries[i].chunk = -1;
+        cz->entries[i].data = malloc((size_t) 1 << cz->chunk_bits);
+        if (!cz->entries[i].data) {
+            fprintf(stderr, "virtio-blk: out of memory\n");
+            exit(2);
+        }
+        list_push(&cz->entries[i].lru, &cz->lru);
+    }
+    pthread_mutex_init(&cz->lock, NULL);
+    cz->enabled = true;
+    return true;
+}
+#endif
+
 static void virtio_blk_write_handler(virtio_blk_state_t *vblk,
-                                     uint64_t sector,
+                                     uint64_t offset,
                                      uint64_t desc_addr,
                                      uint32_t len)
 {
-    void *dest = (void *) ((uintptr_t) vblk->disk + sector * DISK_BLK_SIZE);
+    void *dest = (void *) ((uintptr_t) vblk->disk + offset);
     const void *src = (void *) ((uintptr_t) vblk->ram + desc_addr);
+    if (vblk_cow_of(vblk)->enabled) {
+        vblk_cow_write(vblk_cow_of(vblk), (uint8_t *) vblk->disk, offset, src,
+                       len);
+        return;
+    }
     memcpy(dest, src, len);
 }
 
-static void virtio_blk_read_handler(virtio_blk_state_t *vblk,
-                                    uint64_t sector,
+static bool virtio_blk_read_handler(virtio_blk_state_t *vblk,
+                                    uint64_t offset,
                                     uint64_t desc_addr,
                                     uint32_t len)
 {
     void *dest = (void *) ((uintptr_t) vblk->ram + desc_addr);
-    const void *src =
-        (void *) ((uintptr_t) vblk->disk + sector * DISK_BLK_SIZE);
+#if SEMU_HAS(VBLK_COMPRESS)
+    if (vblk_cz_of(vblk)->enabled)
+        return vblk_cz_read(vblk_cz_of(vblk), offset, dest, len);
+#endif
+    const void *src = (void *) ((uintptr_t) vblk->disk + offset);
+    if (vblk_cow_of(vblk)->enabled) {
+        vblk_cow_read(vblk_cow_of(vblk), (uint8_t *) vblk->disk, offset, dest,
+                      len);
+        return true;
+    }
     memcpy(dest, src, len);
+    return true;
+}
+
+/* Make [offset, offset + len) of the disk read back as zeroes. With "unmap",
+ * the page-aligned part is handed back to the host file system through
+ * MADV_REMOVE, which punches a hole in the file behind the MAP_SHARED mapping
+ * and keeps sparse images sparse. Unaligned edges, hosts without
+ * MADV_REMOVE and file systems that refuse the hole punch fall back to
+ * memset().
+ */
+static void virtio_blk_zero_range(virtio_blk_state_t *vblk,
+                                  uint64_t offset,
+                                  uint64_t len,
+                                  bool unmap)
+{
+    uint8_t *base = (uint8_t *) vblk->disk + offset;
+    if (vblk_cow_of(vblk)->enabled) {
+        /* The base image is never modified */
+        vblk_cow_write(vblk_cow_of(vblk), (uint8_t *) vblk->disk, offset, NULL,
+                       len);
+        return;
+    }
+#if defined(MADV_REMOVE)
+    if (unmap) {
+        uintptr_t page = (uintptr_t) sysconf(_SC_PAGESIZE);
+        uintptr_t start = ((uintptr_t) base + page - 1) & ~(page - 1);
+        uintptr_t end = ((uintptr_t) base + len) & ~(page - 1);
+        if (end > start &&
+            madvise((void *) start, end - start, MADV_REMOVE) == 0) {
+            memset(base, 0, start - (uintptr_t) base);
+            memset((void *) end, 0, (uintptr_t) base + len - end);
+            return;
+        }
+    }
+#else
+    (void) unmap;
+#endif
+    memset(base, 0, len);
+}
+
+/* Release the page-aligned part of [offset, offset + len). The spec leaves
+ * discarded data undefined, so nothing is done when the hole punch is not
+ * possible.
+ */
+static void virtio_blk_discard_range(virtio_blk_state_t *vblk,
+                                     uint64_t offset,
+                                     uint64_t len)
+{
+#if defined(MADV_REMOVE)
+    if (vblk_cow_of(vblk)->enabled)
+        return; /* the base image is shared and read-only */
+    uintptr_t page = (uintptr_t) sysconf(_SC_PAGESIZE);
+    uintptr_t base = (uintptr_t) vblk->disk + offset;
+    uintptr_t start = (base + page - 1) & ~(page - 1);
+    uintptr_t end = (base + len) & ~(page - 1);
+    if (end > start)
+        madvise((void *) start, end - start, MADV_REMOVE);
+#else
+    (void) vblk, (void) offset, (void) len;
+#endif
+}
+
+static uint8_t virtio_blk_discard_handler(virtio_blk_state_t *vblk,
+                                          uint32_t type,
+                                          uint64_t desc_addr,
+                                          uint32_t len)
+{
+    const struct vblk_discard_write_zeroes *seg =
+        (struct vblk_discard_write_zeroes *) ((uintptr_t) vblk->ram +
+                                              desc_addr);
+    uint32_t n_seg = len / sizeof(*seg);
+    uint32_t max_seg = type == VIRTIO_BLK_T_DISCARD
+                           ? PRIV(vblk)->max_discard_seg
+                           : PRIV(vblk)->max_write_zeroes_seg;
+    uint32_t max_sectors = type == VIRTIO_BLK_T_DISCARD
+                               ? PRIV(vblk)->max_discard_sectors
+                               : PRIV(vblk)->max_write_zeroes_sectors;
+
+    if (!n_seg || len % sizeof(*seg) || n_seg > max_seg)
+        return VIRTIO_BLK_S_UNSUPP;
+
+    /* Validate every segment before touching the disk */
+    for (uint32_t i = 0; i < n_seg; i++) {
+        uint32_t flags = seg[i].flags;
+        if ((flags & ~VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP) ||
+            (type == VIRTIO_BLK_T_DISCARD && flags))
+            return VIRTIO_BLK_S_UNSUPP;
+        if (seg[i].num_sectors > max_sectors ||
+            seg[i].sector > PRIV(vblk)->capacity ||
+            seg[i].num_sectors > PRIV(vblk)->capacity - seg[i].sector)
+            return VIRTIO_BLK_S_IOERR;
+    }
+
+    for (uint32_t i = 0; i < n_seg; i++) {
+        uint64_t offset = seg[i].sector * DISK_BLK_SIZE;
+        uint64_t bytes = (uint64_t) seg[i].num_sectors * DISK_BLK_SIZE;
+        if (type == VIRTIO_BLK_T_DISCARD)
+            virtio_blk_discard_range(vblk, offset, bytes);
+        else
+            virtio_blk_zero_range(
+                vblk, offset, bytes,
+                seg[i].flags & VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP);
+    }
+    return VIRTIO_BLK_S_OK;
+}
+
+static uint8_t virtio_blk_flush_handler(virtio_blk_state_t *vblk)
+{
+    int i = vblk_index(vblk);
+    if (vblk_disks[i].addr &&
+        msync(vblk_disks[i].addr, vblk_disks[i].size, MS_SYNC) < 0) {
+        perror("virtio-blk: msync");
+        return VIRTIO_BLK_S_IOERR;
+    }
+    return VIRTIO_BLK_S_OK;
+}
+
+/* virtio_blk_collect_desc() result for a chain that is malformed but ends
+ * in a usable status byte, which already holds VIRTIO_BLK_S_IOERR.
+ */
+#define VBLK_CHAIN_IOERR (-2)
+
+/* Check the shape of a resolved request: a readable header, data buffers
+ * whose direction matches the request type and a writable status byte.
+ */
+static int virtio_blk_check_chain(virtio_blk_state_t *vblk,
+                                  const struct virtq_desc *vq_desc,
+                                  int n_desc)
+{
+    if (n_desc < 2 || !vq_desc[n_desc - 1].len ||
+        !(vq_desc[n_desc - 1].flags & VIRTIO_DESC_F_WRITE))
+        return -1;
+    uint8_t *status =
+        (uint8_t *) ((uintptr_t) vblk->ram + vq_desc[n_desc - 1].addr);
+
+    /* The status byte travels in its own descriptor */
+    if (vq_desc[0].len < offsetof(struct vblk_req_header, status) ||
+        (vq_desc[0].flags & VIRTIO_DESC_F_WRITE)) {
+        *status = VIRTIO_BLK_S_IOERR;
+        return VBLK_CHAIN_IOERR;
+    }
+
+    const struct vblk_req_header *header =
+        (struct vblk_req_header *) ((uintptr_t) vblk->ram + vq_desc[0].addr);
+    bool device_writes = header->type == VIRTIO_BLK_T_IN ||
+                         header->type == VIRTIO_BLK_T_GET_ID ||
+                         header->type == VIRTIO_BLK_T_GET_LIFETIME;
+    for (int i = 1; i < n_desc - 1; i++) {
+        if (!!(vq_desc[i].flags & VIRTIO_DESC_F_WRITE) != device_writes) {
+            *status = VIRTIO_BLK_S_IOERR;
+            return VBLK_CHAIN_IOERR;
+        }
+    }
+    return n_desc;
 }
 
-static int virtio_blk_desc_handler(virtio_blk_state_t *vblk,
+/* Resolve the descriptor chain starting at "desc_idx" into "vq_desc",
+ * following a VIRTQ_DESC_F_INDIRECT table if the head points to one.
+ * Returns the number of descriptors, VBLK_CHAIN_IOERR if the request is to
+ * be failed, or -1 if the chain is malformed beyond reporting an error.
+ */
+static int virtio_blk_collect_desc(virtio_blk_state_t *vblk,
                                    const virtio_blk_queue_t *queue,
                                    uint32_t desc_idx,
-                                   uint32_t *plen)
+                                   struct virtq_desc *vq_desc,
+                                   int max_desc)
 {
-    /* A full virtio_blk_req is represented by 3 descriptors, where
-     * the first descriptor contains:
-     *   le32 type
-     *   le32 reserved
-     *   le64 sector
-     * the second descriptor contains:
-     *   u8 data[][512]
-     * the third descriptor contains:
-     *   u8 status
-     */
-    struct virtq_desc vq_desc[3];
+    uint32_t table = queue->QueueDesc;
+    uint32_t table_num = queue->QueueNum;
+    bool indirect = false;
+    int n_desc = 0;
 
-    /* Collect the descriptors */
-    for (int i = 0; i < 3; i++) {
-        if (desc_idx >= queue->QueueNum) {
-            virtio_blk_set_fail(vblk);
+    for (;;) {
+        if (desc_idx >= table_num || n_desc == max_desc)
             return -1;
-        }
         /* The size of the `struct virtq_desc` is 4 words */
         const struct virtq_desc *desc =
-            (struct virtq_desc *) &vblk->ram[queue->QueueDesc + desc_idx * 4];
+            (struct virtq_desc *) &vblk->ram[table + desc_idx * 4];
+
+        if (desc->flags & VIRTIO_DESC_F_INDIRECT) {
+            /* Only a lone head descriptor may refer to an indirect table,
+             * and the table itself must not nest another one.
+             */
+            if (indirect || n_desc || (desc->flags & VIRTIO_DESC_F_NEXT) ||
+                !desc->len || desc->len % sizeof(struct virtq_desc) ||
+                (desc->addr & 0xF) || desc->addr >= RAM_SIZE ||
+                desc->len > RAM_SIZE - desc->addr)
+                return -1;
+            table = desc->addr >> 2;
+            table_num = desc->len / sizeof(struct virtq_desc);
+            indirect = true;
+            desc_idx = 0;
+            continue;
+        }
+
+        if (desc->addr >= RAM_SIZE || desc->len > RAM_SIZE - desc->addr)
+            return -1;
 
         /* Retrieve the fields of current descriptor */
-        vq_desc[i].addr = desc->addr;
-        vq_desc[i].len = desc->len;
-        vq_desc[i].flags = desc->flags;
+        vq_desc[n_desc].addr = desc->addr;
+        vq_desc[n_desc].len = desc->len;
+        vq_desc[n_desc].flags = desc->flags;
+        n_desc++;
+        if (!(desc->flags & VIRTIO_DESC_F_NEXT))
+            return virtio_blk_check_chain(vblk, vq_desc, n_desc);
         desc_idx = desc->next;
     }
+}
 
-    /* The next flag for the first and second descriptors should be set,
-     * whereas for the third descriptor is should not be set
+/* Execute a request whose descriptors were resolved by
+ * virtio_blk_collect_desc(). The status byte is written back to the guest and
+ * the number of bytes transferred is returned through "plen". This only
+ * touches the request's own buffers and the disk, so it may run on an
+ * asynchronous worker thread.
+ */
+static void virtio_blk_exec_req(virtio_blk_state_t *vblk,
+                                const struct virtq_desc *vq_desc,
+                                int n_desc,
+                                uint32_t *plen)
+{
+    /* A virtio_blk_req is represented by a chain of descriptors, where
+     * the first descriptor contains:
+     *   le32 type
+     *   le32 reserved
+     *   le64 sector
+     * the middle descriptors (up to seg_max of them) contain:
+     *   u8 data[][512], or the discard/write-zeroes segments
+     * the last descriptor contains:
+     *   u8 status
+     * FLUSH requests carry no data descriptor.
      */
-    if (!(vq_desc[0].flags & VIRTIO_DESC_F_NEXT) ||
-        !(vq_desc[1].flags & VIRTIO_DESC_F_NEXT) ||
-        (vq_desc[2].flags & VIRTIO_DESC_F_NEXT)) {
-        /* since the descriptor list is abnormal, we don't write the status
-         * back here */
-        virtio_blk_set_fail(vblk);
-        return -1;
-    }
-
-    /* Process the header */
     const struct vblk_req_header *header =
         (struct vblk_req_header *) ((uintptr_t) vblk->ram + vq_desc[0].addr);
     uint32_t type = header->type;
     uint64_t sector = header->sector;
-    uint8_t *status = (uint8_t *) ((uintptr_t) vblk->ram + vq_desc[2].addr);
+    uint8_t *status =
+        (uint8_t *) ((uintptr_t) vblk->ram + vq_desc[n_desc - 1].addr);
+    const struct virtq_desc *data = &vq_desc[1];
+    int n_data = n_desc - 2;
 
-    /* Check sector index and data length are valid */
-    uint64_t disk_size = (uint64_t) PRIV(vblk)->capacity * DISK_BLK_SIZE;
-    uint64_t offset = sector * DISK_BLK_SIZE;
-    if (sector >= PRIV(vblk)->capacity || vq_desc[1].len > disk_size - offset) {
-        *status = VIRTIO_BLK_S_IOERR;
-        return -1;
-    }
+    *plen = 0;
 
     /* Process the data */
     switch (type) {
     case VIRTIO_BLK_T_IN:
-        virtio_blk_read_handler(vblk, sector, vq_desc[1].addr, vq_desc[1].len);
+    case VIRTIO_BLK_T_OUT: {
+        /* Check sector index and total data length are valid */
+        uint64_t disk_size = (uint64_t) PRIV(vblk)->capacity * DISK_BLK_SIZE;
+        uint64_t offset = sector * DISK_BLK_SIZE;
+        uint64_t total = 0;
+        for (int i = 0; i < n_data; i++)
+            total += data[i].len;
+        if (!n_data || sector >= PRIV(vblk)->capacity ||
+            total > disk_size - offset ||
+            (type == VIRTIO_BLK_T_OUT && vblk_read_only[vblk_index(vblk)])) {
+            *status = VIRTIO_BLK_S_IOERR;
+            return;
+        }
+
+        /* Scatter/gather across the data segments */
+        for (int i = 0; i < n_data; i++) {
+            if (type == VIRTIO_BLK_T_IN) {
+                if (!virtio_blk_read_handler(vblk, offset, data[i].addr,
+                                             data[i].len)) {
+                    *status = VIRTIO_BLK_S_IOERR;
+                    return;
+                }
+            } else {
+                virtio_blk_write_handler(vblk, offset, data[i].addr,
+                                         data[i].len);
+            }
+            offset += data[i].len;
+        }
+        *status = VIRTIO_BLK_S_OK;
+        *plen = (uint32_t) total;
         break;
-    case VIRTIO_BLK_T_OUT:
-        virtio_blk_write_handler(vblk, sector, vq_desc[1].addr, vq_desc[1].len);
+    }
+    case VIRTIO_BLK_T_FLUSH:
+        *status = virtio_blk_flush_handler(vblk);
+        break;
+    case VIRTIO_BLK_T_DISCARD:
+    case VIRTIO_BLK_T_WRITE_ZEROES:
+        /* The segment array is expected in a single buffer */
+        *status = n_data == 1 && !vblk_read_only[vblk_index(vblk)]
+                      ? virtio_blk_discard_handler(
+                                    vblk, type, data->addr, data->len)
+                              : VIRTIO_BLK_S_IOERR;
         break;
     default:
         fprintf(stderr, "unsupported virtio-blk operation!\n");
         *status = VIRTIO_BLK_S_UNSUPP;
-        return -1;
+        break;
+    }
+}
+
+/* Write one used element (`struct virtq_used_elem`) and publish it by bumping
+ * virtq_used.idx.
+ */
+static void virtio_blk_push_used(virtio_blk_state_t *vblk,
+                                 virtio_blk_queue_t *queue,
+                                 uint16_t buffer_idx,
+                                 uint32_t len)
+{
+    uint32_t *ram = vblk->ram;
+    uint16_t new_used = ram[queue->QueueUsed] >> 16; /* virtq_used.idx (le16) */
+    uint32_t vq_used_addr =
+        queue->QueueUsed + 1 + (new_used % queue->QueueNum) * 2;
+    ram[vq_used_addr] = buffer_idx; /* virtq_used_elem.id  (le32) */
+    ram[vq_used_addr + 1] = len;    /* virtq_used_elem.len (le32) */
+    new_used++;
+
+    /* Check le32 len field of `struct virtq_used_elem` on the spec  */
+    ram[queue->QueueUsed] &= MASK(16); /* Reset low 16 bits to zero */
+    ram[queue->QueueUsed] |= ((uint32_t) new_used) << 16; /* len */
+}
+
+/* With VIRTIO_RING_F_EVENT_IDX, the driver publishes used_event after the
+ * available ring and the device publishes avail_event after the used ring.
+ * Each side only notifies the other once the index crosses that value.
+ */
+static inline bool vblk_event_idx(const virtio_blk_state_t *vblk)
+{
+    return vblk->DriverFeatures & VIRTIO_RING_F_EVENT_IDX;
+}
+
+static void virtio_blk_notify_used(virtio_blk_state_t *vblk,
+                                   virtio_blk_queue_t *queue)
+{
+    uint32_t *ram = vblk->ram;
+
+    if (vblk_event_idx(vblk)) {
+        /* virtq_avail.used_event (le16) follows ring[QueueNum] */
+        uint32_t num = queue->QueueNum;
+        uint16_t used_event =
+            ram[queue->QueueAvail + 1 + num / 2] >> (16 * (num % 2));
+        uint16_t new_used = ram[queue->QueueUsed] >> 16;
+        uint16_t old_used = queue->last_signalled;
+        queue->last_signalled = new_used;
+        /* vring_need_event() */
+        if ((uint16_t) (new_used - used_event - 1) <
+            (uint16_t) (new_used - old_used))
+            vblk->InterruptStatus |= VIRTIO_INT__USED_RING;
+        return;
+    }
+
+    /* Send interrupt, unless VIRTQ_AVAIL_F_NO_INTERRUPT is set */
+    if (!(ram[queue->QueueAvail] & 1))
+        vblk->InterruptStatus |= VIRTIO_INT__USED_RING;
+}
+
+/* Ask for the next kick only once the driver adds a buffer past what has
+ * been consumed so far.
+ */
+static void virtio_blk_set_avail_event(virtio_blk_state_t *vblk,
+                                       const virtio_blk_queue_t *queue)
+{
+    /* virtq_used.avail_event (le16) follows ring[QueueNum] */
+    uint32_t *avail_event =
+        &vblk->ram[queue->QueueUsed + 1 + queue->QueueNum * 2];
+    *avail_event = (*avail_event & ~MASK(16)) | queue->last_avail;
+}
+
+/* I/O statistics (-d FILE,stats)
+ *
+ * Per request type: counts, bytes, data segments, errors and a log2
+ * histogram of the latency from the guest's queue notification to the
+ * completion being published. The depth of the queue (new requests plus
+ * those still in flight) is sampled at every notification. Everything is
+ * updated on the emulator thread only, and printed on exit and whenever semu
+ * receives SIGUSR1.
+ */
+enum {
+    VBLK_STAT_READ,
+    VBLK_STAT_WRITE,
+    VBLK_STAT_FLUSH,
+    VBLK_STAT_DISCARD,
+    VBLK_STAT_WRITE_ZEROES,
+    VBLK_STAT_OTHER,
+    VBLK_STAT_TYPES,
+};
+
+#define VBLK_STAT_LAT_BUCKETS 32   /* [2^i, 2^(i+1)) ns, the last open */
+#define VBLK_STAT_DEPTH_BUCKETS 11 /* [2^i, 2^(i+1)) requests, up to 1024 */
+
+static const char *const vblk_stat_names[VBLK_STAT_TYPES] = {
+    "read", "write", "flush", "discard", "write-zeroes", "other",
+};
+
+static struct vblk_stats {
+    bool enabled;
+    struct {
+        uint64_t requests;
+        uint64_t bytes;
+        uint64_t segments;
+        uint64_t errors;
+        uint64_t latency[VBLK_STAT_LAT_BUCKETS];
+    } type[VBLK_STAT_TYPES];
+    uint64_t notifies;
+    uint64_t depth_sum;
+    uint64_t depth_max;
+    uint64_t depth[VBLK_STAT_DEPTH_BUCKETS];
+} vblk_stats[VBLK_DEV_CNT_MAX];
+
+static inline struct vblk_stats *vblk_stats_of(const virtio_blk_state_t *vblk)
+{
+    return &vblk_stats[vblk_index(vblk)];
+}
+
+static inline uint64_t vblk_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline int vblk_log2(uint64_t x)
+{
+    return 63 - __builtin_clzll(x | 1);
+}
+
+static void vblk_stats_notify(virtio_blk_state_t *vblk, uint32_t depth)
+{
+    struct vblk_stats *st = vblk_stats_of(vblk);
+    st->notifies++;
+    st->depth_sum += depth;
+    if (depth > st->depth_max)
+        st->depth_max = depth;
+    st->depth[MIN(vblk_log2(depth), VBLK_STAT_DEPTH_BUCKETS - 1)]++;
+}
+
+/* Account a finished request before it is handed back to the guest, while
+ * its header and status byte are still ours to read.
+ */
+static void vblk_stats_complete(virtio_blk_state_t *vblk,
+                                const struct virtq_desc *vq_desc,
+                                int n_desc,
+                                uint32_t len,
+                                uint64_t start_ns)
+{
+    const struct vblk_req_header *header =
+        (struct vblk_req_header *) ((uintptr_t) vblk->ram + vq_desc[0].addr);
+    uint8_t status =
+        *(uint8_t *) ((uintptr_t) vblk->ram + vq_desc[n_desc - 1].addr);
+    int type;
+
+    switch (header->type) {
+    case VIRTIO_BLK_T_IN:
+        type = VBLK_STAT_READ;
+        break;
+    case VIRTIO_BLK_T_OUT:
+        type = VBLK_STAT_WRITE;
+        break;
+    case VIRTIO_BLK_T_FLUSH:
+        type = VBLK_STAT_FLUSH;
+        break;
+    case VIRTIO_BLK_T_DISCARD:
+        type = VBLK_STAT_DISCARD;
+        break;
+    case VIRTIO_BLK_T_WRITE_ZEROES:
+        type = VBLK_STAT_WRITE_ZEROES;
+        break;
+    default:
+        type = VBLK_STAT_OTHER;
+        break;
+    }
+
+    /* DISCARD and WRITE_ZEROES complete with no used length: count the
+     * sectors their segments covered instead.
+     */
+    uint64_t bytes = len;
+    if ((type == VBLK_STAT_DISCARD || type == VBLK_STAT_WRITE_ZEROES) &&
+        status == VIRTIO_BLK_S_OK) {
+        bytes = 0;
+        for (int i = 1; i < n_desc - 1; i++) {
+            const struct vblk_discard_write_zeroes *seg =
+                (struct vblk_discard_write_zeroes *) ((uintptr_t) vblk->ram +
+                                                      vq_desc[i].addr);
+            for (uint32_t j = 0; j < vq_desc[i].len / sizeof(*seg); j++)
+                bytes += (uint64_t) seg[j].num_sectors * DISK_BLK_SIZE;
+        }
+    }
+
+    struct vblk_stats *st = vblk_stats_of(vblk);
+    st->type[type].requests++;
+    st->type[type].bytes += bytes;
+    st->type[type].segments += n_desc - 2;
+    if (status != VIRTIO_BLK_S_OK)
+        st->type[type].errors++;
+    st->type[type].latency[vblk_log2(vblk_now_ns() - start_ns)]++;
+}
+
+/* Print "2^bucket" nanoseconds with a readable unit */
+static void vblk_stats_print_ns(int bucket)
+{
+    uint64_t ns = 1ULL << bucket;
+    if (ns < 1000)
+        fprintf(stderr, "%" PRIu64 "ns", ns);
+    else if (ns < 1000000)
+        fprintf(stderr, "%" PRIu64 "us", ns / 1000);
+    else
+        fprintf(stderr, "%" PRIu64 "ms", ns / 1000000);
+}
+
+bool virtio_blk_stats_enabled(void)
+{
+    for (int i = 0; i < vblk_dev_cnt; i++) {
+        if (vblk_stats[i].enabled)
+            return true;
+    }
+    return false;
+}
+
+void virtio_blk_print_stats(void)
+{
+    for (int i = 0; i < vblk_dev_cnt; i++) {
+        const struct vblk_stats *st = &vblk_stats[i];
+        if (!st->enabled)
+            continue;
+
+        fprintf(stderr, "\n=== virtio-blk %d Statistics ===\n", i);
+        for (int t = 0; t < VBLK_STAT_TYPES; t++) {
+            if (!st->type[t].requests)
+                continue;
+            fprintf(stderr,
+                    "  %-12s %10" PRIu64 " reqs %14" PRIu64 " bytes %10" PRIu64
+                    " segs %8" PRIu64 " errors\n",
+                    vblk_stat_names[t], st->type[t].requests,
+                    st->type[t].bytes, st->type[t].segments,
+                    st->type[t].errors);
+            fprintf(stderr, "    latency >=");
+            for (int b = 0; b < VBLK_STAT_LAT_BUCKETS; b++) {
+                if (!st->type[t].latency[b])
+                    continue;
+                fprintf(stderr, " ");
+                vblk_stats_print_ns(b);
+                fprintf(stderr, ":%" PRIu64, st->type[t].latency[b]);
+            }
+            fprintf(stderr, "\n");
+        }
+        if (st->notifies) {
+            fprintf(stderr,
+                    "  queue depth  %10" PRIu64 " notifies, avg %.2f, "
+                    "max %" PRIu64 "\n    depth >=",
+                    st->notifies, (double) st->depth_sum / st->notifies,
+                    st->depth_max);
+            for (int b = 0; b < VBLK_STAT_DEPTH_BUCKETS; b++) {
+                if (st->depth[b])
+                    fprintf(stderr, " %d:%" PRIu64, 1 << b, st->depth[b]);
+            }
+            fprintf(stderr, "\n");
+        }
+    }
+}
+
+/* Asynchronous backend (-d file,aio=threads)
+ *
+ * Requests are resolved into descriptor lists on the emulator thread, which
+ * owns the virtqueues, and executed by a pool of worker threads so that page
+ * faults and writeback on the disk mapping no longer stall the harts.
+ * Finished requests are handed back through the "done" list; the emulator
+ * thread publishes them to the used ring from virtio_blk_refresh_queue(). A
+ * byte on the wake pipe lets an idle emulator loop blocked in poll() notice
+ * completions.
+ */
+#define VBLK_AIO_WORKERS 4
+
+typedef struct {
+    struct list_head list;
+    int queue_idx;
+    uint16_t buffer_idx;
+    uint32_t len;
+    uint64_t start_ns; /* notification time, for the statistics */
+    int n_desc;
+    struct virtq_desc desc[VBLK_SEG_MAX + 2];
+} vblk_aio_req_t;
+
+static struct vblk_aio {
+    bool enabled;
+    bool stopping;
+    virtio_blk_state_t *vblk;
+    pthread_t workers[VBLK_AIO_WORKERS];
+    pthread_mutex_t lock;
+    pthread_cond_t submit_cond;
+    pthread_cond_t done_cond;
+    struct list_head submit;
+    struct list_head done;
+    uint32_t in_flight;
+    int wake_fd[2];
+} vblk_aio[VBLK_DEV_CNT_MAX];
+
+static inline struct vblk_aio *vblk_aio_of(const virtio_blk_state_t *vblk)
+{
+    return &vblk_aio[vblk_index(vblk)];
+}
+
+static void *virtio_blk_aio_worker(void *arg)
+{
+    struct vblk_aio *aio = arg;
+
+    pthread_mutex_lock(&aio->lock);
+    for (;;) {
+        while (list_empty(&aio->submit) && !aio->stopping)
+            pthread_cond_wait(&aio->submit_cond, &aio->lock);
+        /* Requests already submitted are finished before stopping */
+        if (list_empty(&aio->submit))
+            break;
+
+        vblk_aio_req_t *req =
+            list_first_entry(&aio->submit, vblk_aio_req_t, list);
+        list_del(&req->list);
+        pthread_mutex_unlock(&aio->lock);
+
+        virtio_blk_exec_req(aio->vblk, req->desc, req->n_desc, &req->len);
+
+        pthread_mutex_lock(&aio->lock);
+        bool was_empty = list_empty(&aio->done);
+        list_push(&req->list, &aio->done);
+        if (was_empty) {
+            ssize_t n = write(aio->wake_fd[1], "", 1);
+            (void) n;
+        }
+        pthread_cond_broadcast(&aio->done_cond);
+    }
+    pthread_mutex_unlock(&aio->lock);
+    return NULL;
+}
+
+/* Drain the submitted requests and join the workers of every device. Runs
+ * at exit, ahead of virtio_blk_sync_all() whichever hook comes first.
+ */
+static void virtio_blk_aio_stop_all(void)
+{
+    for (int i = 0; i < VBLK_DEV_CNT_MAX; i++) {
+        struct vblk_aio *aio = &vblk_aio[i];
+        if (!aio->enabled)
+            continue;
+        pthread_mutex_lock(&aio->lock);
+        aio->stopping = true;
+        pthread_cond_broadcast(&aio->submit_cond);
+        pthread_mutex_unlock(&aio->lock);
+        for (int w = 0; w < VBLK_AIO_WORKERS; w++)
+            pthread_join(aio->workers[w], NULL);
+        aio->enabled = false;
+    }
+}
+
+static bool virtio_blk_aio_init(virtio_blk_state_t *vblk)
+{
+    struct vblk_aio *aio = vblk_aio_of(vblk);
+
+    aio->vblk = vblk;
+    INIT_LIST_HEAD(&aio->submit);
+    INIT_LIST_HEAD(&aio->done);
+    pthread_mutex_init(&aio->lock, NULL);
+    pthread_cond_init(&aio->submit_cond, NULL);
+    pthread_cond_init(&aio->done_cond, NULL);
+    if (pipe(aio->wake_fd) < 0) {
+        perror("virtio-blk: pipe");
+        return false;
+    }
+    for (int i = 0; i < 2; i++)
+        fcntl(aio->wake_fd[i], F_SETFL,
+              fcntl(aio->wake_fd[i], F_GETFL, 0) | O_NONBLOCK);
+
+    for (int i = 0; i < VBLK_AIO_WORKERS; i++) {
+        if (pthread_create(&aio->workers[i], NULL, virtio_blk_aio_worker,
+                           aio) != 0) {
+            fprintf(stderr, "virtio-blk: failed to start I/O worker\n");
+            return false;
+        }
+    }
+    aio->enabled = true;
+
+    static bool registered = false;
+    if (!registered)
+        atexit(virtio_blk_aio_stop_all);
+    registered = true;
+    return true;
+}
+
+static void virtio_blk_aio_submit(virtio_blk_state_t *vblk,
+                                  int queue_idx,
+                                  uint16_t buffer_idx,
+                                  const struct virtq_desc *vq_desc,
+                                  int n_desc,
+                                  uint64_t start_ns)
+{
+    struct vblk_aio *aio = vblk_aio_of(vblk);
+    vblk_aio_req_t *req = malloc(sizeof(*req));
+    if (!req) {
+        /* Out of memory: run the request synchronously instead */
+        uint32_t len;
+        virtio_blk_exec_req(vblk, vq_desc, n_desc, &len);
+        if (vblk_stats_of(vblk)->enabled)
+            vblk_stats_complete(vblk, vq_desc, n_desc, len, start_ns);
+        virtio_blk_push_used(vblk, &vblk->queues[queue_idx], buffer_idx, len);
+        virtio_blk_notify_used(vblk, &vblk->queues[queue_idx]);
+        return;
+    }
+    req->queue_idx = queue_idx;
+    req->buffer_idx = buffer_idx;
+    req->n_desc = n_desc;
+    req->start_ns = start_ns;
+    memcpy(req->desc, vq_desc, n_desc * sizeof(*vq_desc));
+
+    pthread_mutex_lock(&aio->lock);
+    list_push(&req->list, &aio->submit);
+    aio->in_flight++;
+    pthread_cond_signal(&aio->submit_cond);
+    pthread_mutex_unlock(&aio->lock);
+}
+
+/* Publish finished requests to the used rings. Returns how many completed. */
+static uint32_t virtio_blk_aio_complete(virtio_blk_state_t *vblk)
+{
+    struct vblk_aio *aio = vblk_aio_of(vblk);
+    list_HEAD(done);
+    char buf[64];
+
+    while (read(aio->wake_fd[0], buf, sizeof(buf)) > 0)
+        ;
+
+    pthread_mutex_lock(&aio->lock);
+    if (!list_empty(&aio->done)) {
+        /* Splice the whole list out under the lock */
+        done.next = aio->done.next;
+        done.prev = aio->done.prev;
+        done.next->prev = &done;
+        done.prev->next = &done;
+        INIT_LIST_HEAD(&aio->done);
+    }
+    pthread_mutex_unlock(&aio->lock);
+
+    uint32_t completed = 0;
+    uint32_t queues_done = 0;
+    struct list_head *node, *safe;
+    list_for_each_safe (node, safe, &done) {
+        vblk_aio_req_t *req = list_entry(node, vblk_aio_req_t, list);
+        /* Results for a queue reset meanwhile are dropped */
+        if (vblk->queues[req->queue_idx].ready) {
+            if (vblk_stats_of(vblk)->enabled)
+                vblk_stats_complete(vblk, req->desc, req->n_desc, req->len,
+                                    req->start_ns);
+            virtio_blk_push_used(vblk, &vblk->queues[req->queue_idx],
+                                 req->buffer_idx, req->len);
+            queues_done |= 1U << req->queue_idx;
+        }
+        list_del(node);
+        free(req);
+        completed++;
     }
 
-    /* Return the device status */
-    *status = VIRTIO_BLK_S_OK;
-    *plen = vq_desc[1].len;
+    for (uint32_t i = 0; i < PRIV(vblk)->num_queues; i++) {
+        if (queues_done & (1U << i))
+            virtio_blk_notify_used(vblk, &vblk->queues[i]);
+    }
 
-    return 0;
+    if (completed) {
+        pthread_mutex_lock(&aio->lock);
+        aio->in_flight -= completed;
+        pthread_mutex_unlock(&aio->lock);
+    }
+    return completed;
+}
+
+/* Wait for every in-flight request, e.g. before a device reset. */
+static void virtio_blk_aio_drain(virtio_blk_state_t *vblk)
+{
+    struct vblk_aio *aio = vblk_aio_of(vblk);
+
+    for (;;) {
+        virtio_blk_aio_complete(vblk);
+        pthread_mutex_lock(&aio->lock);
+        uint32_t pending = aio->in_flight;
+        bool has_done = !list_empty(&aio->done);
+        if (pending && !has_done)
+            pthread_cond_wait(&aio->done_cond, &aio->lock);
+        pthread_mutex_unlock(&aio->lock);
+        if (!pending)
+            return;
+    }
 }
 
 static void virtio_queue_notify_handler(virtio_blk_state_t *vblk, int index)
 {
     uint32_t *ram = vblk->ram;
     virtio_blk_queue_t *queue = &vblk->queues[index];
+    bool async = vblk_aio_of(vblk)->enabled;
     if (vblk->Status & VIRTIO_STATUS__DEVICE_NEEDS_RESET)
         return;
 
@@ -244,8 +1375,16 @@ static void virtio_queue_notify_handler(virtio_blk_state_t *vblk, int index)
     if (queue->last_avail == new_avail)
         return;
 
+    bool stats = vblk_stats_of(vblk)->enabled;
+    uint64_t start_ns = 0;
+    if (stats) {
+        start_ns = vblk_now_ns();
+        vblk_stats_notify(vblk, (uint16_t) (new_avail - queue->last_avail) +
+                                    (async ? vblk_aio_of(vblk)->in_flight : 0));
+    }
+
     /* Process them */
-    uint16_t new_used = ram[queue->QueueUsed] >> 16; /* virtq_used.idx (le16) */
+    bool used = false;
     while (queue->last_avail != new_avail) {
         /* Obtain the index in the ring buffer */
         uint16_t queue_idx = queue->last_avail % queue->QueueNum;
@@ -259,31 +1398,70 @@ static void virtio_queue_notify_handler(virtio_blk_state_t *vblk, int index)
         uint16_t buffer_idx = ram[queue->QueueAvail + 1 + queue_idx / 2] >>
                               (16 * (queue_idx % 2));
 
-        /* Consume request from the available queue and process the data in the
+        /* Consume request from the available queue and resolve its
          * descriptor list.
          */
-        uint32_t len = 0;
-        int result = virtio_blk_desc_handler(vblk, queue, buffer_idx, &len);
-        if (result != 0)
+        struct virtq_desc vq_desc[VBLK_SEG_MAX + 2];
+        int n_desc = virtio_blk_collect_desc(vblk, queue, buffer_idx, vq_desc,
+                                             ARRAY_SIZE(vq_desc));
+        if (n_desc == VBLK_CHAIN_IOERR) {
+            /* Rejected, with the error already in its status byte */
+            queue->last_avail++;
+            virtio_blk_push_used(vblk, queue, buffer_idx, 0);
+            used = true;
+            continue;
+        }
+        if (n_desc < 2) {
+            /* since the descriptor list is abnormal, we don't write the
+             * status back here */
             return virtio_blk_set_fail(vblk);
-
-        /* Write used element information (`struct virtq_used_elem`) to the used
-         * queue */
-        uint32_t vq_used_addr =
-            queue->QueueUsed + 1 + (new_used % queue->QueueNum) * 2;
-        ram[vq_used_addr] = buffer_idx; /* virtq_used_elem.id  (le32) */
-        ram[vq_used_addr + 1] = len;    /* virtq_used_elem.len (le32) */
+        }
         queue->last_avail++;
-        new_used++;
+
+        if (async) {
+            virtio_blk_aio_submit(vblk, index, buffer_idx, vq_desc, n_desc,
+                                  start_ns);
+            continue;
+        }
+
+        uint32_t len = 0;
+        virtio_blk_exec_req(vblk, vq_desc, n_desc, &len);
+        if (stats)
+            vblk_stats_complete(vblk, vq_desc, n_desc, len, start_ns);
+        virtio_blk_push_used(vblk, queue, buffer_idx, len);
+        used = true;
     }
 
-    /* Check le32 len field of `struct virtq_used_elem` on the spec  */
-    vblk->ram[queue->QueueUsed] &= MASK(16); /* Reset low 16 bits to zero */
-    vblk->ram[queue->QueueUsed] |= ((uint32_t) new_used) << 16; /* len */
+    if (vblk_event_idx(vblk))
+        virtio_blk_set_avail_event(vblk, queue);
 
-    /* Send interrupt, unless VIRTQ_AVAIL_F_NO_INTERRUPT is set */
-    if (!(ram[queue->QueueAvail] & 1))
-        vblk->InterruptStatus |= VIRTIO_INT__USED_RING;
+    if (used)
+        virtio_blk_notify_used(vblk, queue);
+}
+
+static void virtio_blk_update_status(virtio_blk_state_t *vblk, uint32_t status)
+{
+    vblk->Status |= status;
+    if (status)
+        return;
+
+    /* Reset: let in-flight asynchronous requests finish first so that no
+     * worker writes into buffers the driver is about to reclaim.
+     */
+    if (vblk_aio_of(vblk)->enabled) {
+        for (uint32_t i = 0; i < PRIV(vblk)->num_queues; i++)
+            vblk->queues[i].ready = false;
+        virtio_blk_aio_drain(vblk);
+    }
+    uint32_t *ram = vblk->ram;
+    uint32_t *disk = vblk->disk;
+    void *priv = vblk->priv;
+    uint32_t capacity = PRIV(vblk)->capacity;
+    memset(vblk, 0, sizeof(*vblk));
+    vblk->ram = ram;
+    vblk->disk = disk;
+    vblk->priv = priv;
+    PRIV(vblk)->capacity = capacity;
 }
 
 static bool virtio_blk_reg_read(virtio_blk_state_t *vblk,
@@ -291,6 +1469,14 @@ static bool virtio_blk_reg_read(virtio_blk_state_t *vblk,
                                 uint32_t *value)
 {
 #define _(reg) VIRTIO_##reg
+    /* A disk slot without a device is a virtio-mmio placeholder: device ID 0
+     * tells the driver to skip it.
+     */
+    if (!vblk->priv && addr != _(MagicValue) && addr != _(Version)) {
+        *value = 0;
+        return true;
+    }
+
     switch (addr) {
     case _(MagicValue):
         *value = 0x74726976;
@@ -306,11 +1492,15 @@ static bool virtio_blk_reg_read(virtio_blk_state_t *vblk,
         return true;
     case _(DeviceFeatures):
         *value = vblk->DeviceFeaturesSel == 0
-                     ? VBLK_FEATURES_0
+                     ? VBLK_FEATURES_0 | (vblk_read_only[vblk_index(vblk)]
+                                              ? VIRTIO_BLK_F_RO
+                                              : 0)
                      : (vblk->DeviceFeaturesSel == 1 ? VBLK_FEATURES_1 : 0);
         return true;
     case _(QueueNumMax):
-        *value = VBLK_QUEUE_NUM_MAX;
+        /* Queues beyond num_queues do not exist */
+        *value = vblk->QueueSel < PRIV(vblk)->num_queues ? VBLK_QUEUE_NUM_MAX
+                                                         : 0;
         return true;
     case _(QueueReady):
         *value = VBLK_QUEUE.ready ? 1 : 0;
@@ -342,6 +1532,9 @@ static bool virtio_blk_reg_write(virtio_blk_state_t *vblk,
                                  uint32_t value)
 {
 #define _(reg) VIRTIO_##reg
+    if (!vblk->priv)
+        return true; /* placeholder slot */
+
     switch (addr) {
     case _(DeviceFeaturesSel):
         vblk->DeviceFeaturesSel = value;
@@ -366,8 +1559,11 @@ static bool virtio_blk_reg_write(virtio_blk_state_t *vblk,
         return true;
     case _(QueueReady):
         VBLK_QUEUE.ready = value & 1;
-        if (value & 1)
+        if (value & 1) {
             VBLK_QUEUE.last_avail = vblk->ram[VBLK_QUEUE.QueueAvail] >> 16;
+            VBLK_QUEUE.last_signalled =
+                vblk->ram[VBLK_QUEUE.QueueUsed] >> 16;
+        }
         return true;
     case _(QueueDescLow):
         VBLK_QUEUE.QueueDesc = vblk_preprocess(vblk, value);
@@ -391,7 +1587,7 @@ static bool virtio_blk_reg_write(virtio_blk_state_t *vblk,
             virtio_blk_set_fail(vblk);
         return true;
     case _(QueueNotify):
-        if (value < ARRAY_SIZE(vblk->queues))
+        if (value < PRIV(vblk)->num_queues)
             virtio_queue_notify_handler(vblk, value);
         else
             virtio_blk_set_fail(vblk);
@@ -459,7 +1655,85 @@ void virtio_blk_write(hart_t *vm,
     }
 }
 
-uint32_t *virtio_blk_init(virtio_blk_state_t *vblk, char *disk_file)
+void virtio_blk_refresh_queue(virtio_blk_state_t *vblk)
+{
+    if (vblk->priv && vblk_aio_of(vblk)->enabled)
+        virtio_blk_aio_complete(vblk);
+}
+
+int virtio_blk_wake_fd(const virtio_blk_state_t *vblk)
+{
+    if (!vblk->priv || !vblk_aio_of(vblk)->enabled)
+        return -1;
+    return vblk_aio_of(vblk)->wake_fd[0];
+}
+
+/* Per-device options given as "-d FILE[,OPTION...]" */
+typedef struct {
+    char *path;
+    bool aio_threads; /* aio=threads: execute requests on worker threads */
+    char *overlay;    /* overlay=FILE: copy-on-write over a read-only base */
+    bool snapshot;    /* snapshot: discard guest writes on exit */
+    bool read_only;   /* ro: expose the disk with VIRTIO_BLK_F_RO */
+    uint64_t cache_size; /* cache=SIZE: decompression cache, in bytes */
+    bool stats;          /* stats: collect I/O statistics */
+} vblk_options_t;
+
+static void virtio_blk_parse_options(char *spec, vblk_options_t *opts)
+{
+    memset(opts, 0, sizeof(*opts));
+    opts->cache_size = VBLK_CZ_CACHE_DEFAULT;
+    opts->path = strtok(spec, ",");
+    for (char *opt; (opt = strtok(NULL, ","));) {
+        if (!strcmp(opt, "aio=threads")) {
+            opts->aio_threads = true;
+        } else if (!strcmp(opt, "aio=sync")) {
+            opts->aio_threads = false;
+        } else if (!strncmp(opt, "overlay=", 8) && opt[8]) {
+            opts->overlay = opt + 8;
+        } else if (!strcmp(opt, "snapshot")) {
+            opts->snapshot = true;
+        } else if (!strcmp(opt, "stats")) {
+            opts->stats = true;
+        } else if (!strcmp(opt, "ro")) {
+            opts->read_only = true;
+        } else if (!strncmp(opt, "cache=", 6)) {
+            /* SIZE in bytes, with an optional K, M or G suffix */
+            char *end;
+            errno = 0;
+            opts->cache_size = strtoull(opt + 6, &end, 10);
+            int shift = !*end ? 0 : strchr("Kk", *end) ? 10
+                                : strchr("Mm", *end) ? 20
+                                : strchr("Gg", *end) ? 30
+                                                     : -1;
+            if (errno || end == opt + 6 || shift < 0 || (*end && end[1])) {
+                fprintf(stderr, "virtio-blk: invalid cache size '%s'\n",
+                        opt + 6);
+                exit(2);
+            }
+            opts->cache_size <<= shift;
+        } else {
+            fprintf(stderr, "unknown virtio-blk option '%s'\n", opt);
+            exit(2);
+        }
+    }
+    if (!opts->path) {
+        fprintf(stderr, "virtio-blk: missing disk image path\n");
+        exit(2);
+    }
+    if (opts->snapshot && opts->overlay) {
+        fprintf(stderr, "virtio-blk: snapshot and overlay= are exclusive\n");
+        exit(2);
+    }
+    if (opts->read_only && opts->overlay) {
+        fprintf(stderr, "virtio-blk: ro and overlay= are exclusive\n");
+        exit(2);
+    }
+}
+
+uint32_t *virtio_blk_init(virtio_blk_state_t *vblk,
+                          char *disk_spec,
+                          uint32_t num_queues)
 {
     if (vblk_dev_cnt >= VBLK_DEV_CNT_MAX) {
         fprintf(stderr,
@@ -471,16 +1745,35 @@ uint32_t *virtio_blk_init(virtio_blk_state_t *vblk, char *disk_file)
     /* Allocate memory for the private member */
     vblk->priv = &vblk_configs[vblk_dev_cnt++];
 
+    /* One request queue per hart, so that guest CPUs do not contend on a
+     * single queue lock.
+     */
+    if (num_queues < 1)
+        num_queues = 1;
+    PRIV(vblk)->num_queues = MIN(num_queues, ARRAY_SIZE(vblk->queues));
+
     /* No disk image is provided */
-    if (!disk_file) {
+    if (!disk_spec) {
         /* By setting the block capacity to zero, the kernel will
          * then not to touch the device after booting */
         PRIV(vblk)->capacity = 0;
         return NULL;
     }
 
-    /* Open disk file */
-    int disk_fd = open(disk_file, O_RDWR);
+    vblk_options_t opts;
+    char *spec = strdup(disk_spec);
+    if (!spec) {
+        fprintf(stderr, "virtio-blk: out of memory\n");
+        exit(2);
+    }
+    virtio_blk_parse_options(spec, &opts);
+    char *disk_file = opts.path;
+
+    /* Open disk file. With an overlay, in snapshot mode or for a read-only
+     * device, the image itself is only ever read.
+     */
+    bool read_only = opts.overlay || opts.snapshot || opts.read_only;
+    int disk_fd = open(disk_file, read_only ? O_RDONLY : O_RDWR);
     if (disk_fd < 0) {
         fprintf(stderr, "could not open %s\n", disk_file);
         exit(2);
@@ -499,25 +1792,96 @@ uint32_t *virtio_blk_init(virtio_blk_state_t *vblk, char *disk_file)
         exit(2);
     }
     size_t disk_size = st.st_size;
+    vblk_read_only[vblk_index(vblk)] = opts.read_only;
 
-    /* Set up the disk memory */
-    uint32_t *disk_mem =
-        mmap(NULL, disk_size, PROT_READ | PROT_WRITE, MAP_SHARED, disk_fd, 0);
-    if (disk_mem == MAP_FAILED) {
-        fprintf(stderr, "Could not map disk\n");
-        return NULL;
+    uint32_t *disk_mem = NULL;
+    void *sync_addr = NULL;
+    size_t sync_size = disk_size;
+    if (vblk_cz_probe(disk_fd)) {
+        /* Compressed images are served from the decompression cache and
+         * have no flat mapping to write to or sync.
+         */
+        if (opts.overlay || opts.snapshot) {
+            fprintf(stderr, "%s: compressed images are read-only\n",
+                    disk_file);
+            exit(2);
+        }
+#if SEMU_HAS(VBLK_COMPRESS)
+        if (!vblk_cz_open(vblk_cz_of(vblk), disk_fd, disk_size,
+                          opts.cache_size)) {
+            fprintf(stderr, "%s is not a valid compressed image\n",
+                    disk_file);
+            exit(2);
+        }
+        vblk_read_only[vblk_index(vblk)] = true;
+        disk_size = vblk_cz_of(vblk)->disk_size;
+#else
+        fprintf(stderr, "%s is compressed, but semu was built without zlib\n",
+                disk_file);
+        exit(2);
+#endif
+    } else {
+        /* Set up the disk memory. A snapshot is a private mapping: guest
+         * writes stay in anonymous copy-on-write pages and vanish on exit.
+         */
+        int prot = opts.overlay || opts.read_only ? PROT_READ
+                                                  : PROT_READ | PROT_WRITE;
+        int flags = opts.snapshot ? MAP_PRIVATE : MAP_SHARED;
+        disk_mem = mmap(NULL, disk_size, prot, flags, disk_fd, 0);
+        if (disk_mem == MAP_FAILED) {
+            fprintf(stderr, "Could not map disk\n");
+            close(disk_fd);
+            free(spec);
+            return NULL;
+        }
+        assert(!(((uintptr_t) disk_mem) & 0b11));
+
+        /* Guest writes go to the overlay, which is what needs syncing.
+         * Snapshots and read-only disks have nothing to sync, so FLUSH
+         * completes at once and the exit-time msync is skipped.
+         */
+        if (opts.overlay) {
+            sync_addr = vblk_cow_open(vblk_cow_of(vblk), opts.overlay,
+                                      disk_size, &sync_size);
+            if (!sync_addr)
+                exit(2);
+        } else if (!opts.snapshot && !opts.read_only) {
+            sync_addr = disk_mem;
+        }
     }
-    assert(!(((uintptr_t) disk_mem) & 0b11));
     close(disk_fd);
 
     vblk->disk = disk_mem;
     PRIV(vblk)->capacity = (disk_size - 1) / DISK_BLK_SIZE + 1;
+    PRIV(vblk)->size_max = VBLK_SIZE_MAX;
+    PRIV(vblk)->seg_max = VBLK_SEG_MAX;
+    PRIV(vblk)->max_discard_sectors = VBLK_DWZ_SECTORS_MAX;
+    PRIV(vblk)->max_discard_seg = VBLK_DWZ_SEG_MAX;
+    PRIV(vblk)->discard_sector_alignment =
+        (uint32_t) sysconf(_SC_PAGESIZE) / DISK_BLK_SIZE;
+    PRIV(vblk)->max_write_zeroes_sectors = VBLK_DWZ_SECTORS_MAX;
+    PRIV(vblk)->max_write_zeroes_seg = VBLK_DWZ_SEG_MAX;
+    PRIV(vblk)->write_zeroes_may_unmap = 1;
+
+    if (sync_addr) {
+        if (vblk_disks_cnt == 0)
+            atexit(virtio_blk_sync_all);
+        vblk_disks[vblk_index(vblk)].addr = sync_addr;
+        vblk_disks[vblk_index(vblk)].size = sync_size;
+        vblk_disks_cnt = vblk_index(vblk) + 1;
+    }
+
+    if (opts.stats) {
+        static bool registered = false;
+        if (!registered)
+            atexit(virtio_blk_print_stats);
+        registered = true;
+        vblk_stats_of(vblk)->enabled = true;
+    }
 
-    if (vblk_disks_cnt == 0)
-        atexit(virtio_blk_sync_all);
-    vblk_disks[vblk_disks_cnt].addr = disk_mem;
-    vblk_disks[vblk_disks_cnt].size = disk_size;
-    vblk_disks_cnt++;
+    if (opts.aio_threads && !virtio_blk_aio_init(vblk))
+        fprintf(stderr, "%s: falling back to synchronous I/O\n", disk_file);
+    free(spec);
 
     return disk_mem;
 }
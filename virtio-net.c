@@ -24,14 +24,40 @@
 
 #define VNET_DEV_CNT_MAX 1
 
-#define VNET_FEATURES_0 0
-#define VNET_FEATURES_1 1 /* VIRTIO_F_VERSION_1 */
+#define VNET_FEATURES_0                                                \
+    (VIRTIO_NET_F_CSUM | VIRTIO_NET_F_GUEST_CSUM |                     \
+     VIRTIO_NET_F_GUEST_TSO4 | VIRTIO_NET_F_GUEST_TSO6 |               \
+     VIRTIO_NET_F_HOST_TSO4 | VIRTIO_NET_F_HOST_TSO6 |                 \
+     VIRTIO_NET_F_MRG_RXBUF)
+#define VNET_FEATURES_1 \
+    (1 /* VIRTIO_F_VERSION_1 */ | VIRTIO_NET_F_NOTF_COAL)
 #define VNET_QUEUE_NUM_MAX 1024
 #define VNET_QUEUE (vnet->queues[vnet->QueueSel])
 
+/* Largest frame the guest may hand over with TSO: a 64 KiB IP datagram plus
+ * the Ethernet and VLAN headers.
+ */
+#define VNET_TX_FRAME_MAX (65536 + 18)
+/* Upper bound on Ethernet + IP + TCP headers replicated into each segment */
+#define VNET_TX_HDRS_MAX 256
+
+/* Bounds on the guest buffers a single received frame may span */
+#define VNET_RX_BUFS_MAX 64
+#define VNET_RX_IOV_MAX 128
+
+#define ETH_P_IP_ 0x0800
+#define ETH_P_IPV6_ 0x86DD
+#define ETH_P_8021Q_ 0x8100
+#define TCP_FLAG_FIN 0x01
+#define TCP_FLAG_PSH 0x08
+#define TCP_FLAG_CWR 0x80
+
 #define PRIV(x) ((struct virtio_net_config *) x->priv)
 
-enum { VNET_QUEUE_RX = 0, VNET_QUEUE_TX = 1 };
+/* Queues come in RX/TX pairs, followed by the control queue */
+#define VNET_QUEUE_RX(pair) ((pair) * 2)
+#define VNET_QUEUE_TX(pair) ((pair) * 2 + 1)
+#define VNET_QUEUE_PAIR(vnet, queue) ((uint32_t) ((queue) - (vnet)->queues) / 2)
 
 PACKED(struct virtio_net_config {
     uint8_t mac[6];
@@ -40,6 +66,16 @@ PACKED(struct virtio_net_config {
     uint16_t mtu;
 });
 
+PACKED(struct virtio_net_hdr {
+    uint8_t flags;
+    uint8_t gso_type;
+    uint16_t hdr_len;
+    uint16_t gso_size;
+    uint16_t csum_start;
+    uint16_t csum_offset;
+    uint16_t num_buffers;
+});
+
 static struct virtio_net_config vnet_configs[VNET_DEV_CNT_MAX];
 static int vnet_dev_cnt = 0;
 
@@ -50,6 +86,53 @@ static void virtio_net_set_fail(virtio_net_state_t *vnet)
         vnet->InterruptStatus |= VIRTIO_INT__CONF_CHANGE;
 }
 
+#if !defined(__APPLE__)
+static net_vhost_user_options_t *vnet_vhost_user(
+    const virtio_net_state_t *vnet)
+{
+    if (vnet->peer.op && vnet->peer.type == NETDEV_IMPL_vhost_user)
+        return (net_vhost_user_options_t *) vnet->peer.op;
+    return NULL;
+}
+#endif
+
+static uint32_t vnet_features_0(const virtio_net_state_t *vnet)
+{
+    /* The control queue carries the coalescing commands */
+    uint32_t features = VNET_FEATURES_0 | VIRTIO_NET_F_CTRL_VQ;
+#if !defined(__APPLE__)
+    /* Offloads are up to the vhost-user back-end, which moves the frames */
+    net_vhost_user_options_t *vu = vnet_vhost_user(vnet);
+    if (vu)
+        features = (VNET_FEATURES_0 & vu->features) | VIRTIO_NET_F_CTRL_VQ;
+#endif
+    if (vnet->num_pairs > 1)
+        features |= VIRTIO_NET_F_MQ;
+    return features;
+}
+
+static uint32_t vnet_features_1(const virtio_net_state_t *vnet)
+{
+#if !defined(__APPLE__)
+    /* Interrupts follow the back-end's calls, so they are not coalesced */
+    if (vnet_vhost_user(vnet))
+        return 1; /* VIRTIO_F_VERSION_1 */
+#else
+    (void) vnet;
+#endif
+    return VNET_FEATURES_1;
+}
+
+/* Index of the control queue, which follows the last pair the driver may
+ * use.
+ */
+static uint32_t vnet_ctrl_queue(const virtio_net_state_t *vnet)
+{
+    if (vnet->DriverFeatures & VIRTIO_NET_F_MQ)
+        return vnet->num_pairs * 2;
+    return 2;
+}
+
 static inline uint32_t vnet_preprocess(virtio_net_state_t *vnet, uint32_t addr)
 {
     if ((addr >= RAM_SIZE) || (addr & 0b11))
@@ -58,19 +141,83 @@ static inline uint32_t vnet_preprocess(virtio_net_state_t *vnet, uint32_t addr)
     return addr >> 2;
 }
 
+/* Let the backend generate checksum-less and oversized frames only for the
+ * offloads the driver accepted.
+ */
+static void virtio_net_set_offload(virtio_net_state_t *vnet, uint32_t features)
+{
+#if !defined(__APPLE__)
+    if (vnet->peer.op && vnet->peer.type == NETDEV_IMPL_tap)
+        net_tap_set_offload((net_tap_options_t *) vnet->peer.op,
+                            features & VIRTIO_NET_F_GUEST_CSUM,
+                            features & VIRTIO_NET_F_GUEST_TSO4,
+                            features & VIRTIO_NET_F_GUEST_TSO6);
+#else
+    (void) vnet, (void) features;
+#endif
+}
+
+/* Hand the RX/TX pair over to the vhost-user back-end */
+static void virtio_net_vhost_start(virtio_net_state_t *vnet)
+{
+#if !defined(__APPLE__)
+    net_vhost_user_options_t *vu = vnet_vhost_user(vnet);
+    if (!vu)
+        return;
+
+    net_vhost_user_ring_t ring[NET_VHOST_USER_RINGS];
+    for (int i = 0; i < NET_VHOST_USER_RINGS; i++) {
+        const virtio_net_queue_t *queue = &vnet->queues[i];
+        ring[i] = (net_vhost_user_ring_t) {
+            .num = queue->QueueNum,
+            .desc = vnet->ram + queue->QueueDesc,
+            .avail = vnet->ram + queue->QueueAvail,
+            .used = vnet->ram + queue->QueueUsed,
+            .last_avail = queue->last_avail,
+        };
+    }
+    uint64_t features = (uint64_t) vnet->DriverFeatures1 << 32 |
+                        (vnet->DriverFeatures & VNET_FEATURES_0);
+    if (!net_vhost_user_start(vu, features, ring))
+        virtio_net_set_fail(vnet);
+#else
+    (void) vnet;
+#endif
+}
+
 static void virtio_net_update_status(virtio_net_state_t *vnet, uint32_t status)
 {
+    bool start = (status & VIRTIO_STATUS__DRIVER_OK) &&
+                 !(vnet->Status & VIRTIO_STATUS__DRIVER_OK);
+    if (start)
+        virtio_net_set_offload(vnet, vnet->DriverFeatures);
     vnet->Status |= status;
+    if (start)
+        virtio_net_vhost_start(vnet);
     if (status)
         return;
 
     /* Reset */
+#if !defined(__APPLE__)
+    if (vnet_vhost_user(vnet))
+        net_vhost_user_stop(vnet_vhost_user(vnet));
+#endif
+    virtio_net_set_offload(vnet, 0);
+    if (vnet->peer.op)
+        netdev_set_queues(&vnet->peer, 1);
     netdev_t peer = vnet->peer;
     uint32_t *ram = vnet->ram;
     void *priv = vnet->priv;
+    uint32_t num_pairs = vnet->num_pairs;
+    semu_timer_t *guest_clock = vnet->guest_clock;
+    net_pcap_t *pcap = vnet->pcap;
+    virtio_net_coal_t rx_coal = vnet->rx_coal_default;
     memset(vnet, 0, sizeof(*vnet));
     vnet->peer = peer, vnet->ram = ram;
     vnet->priv = priv;
+    vnet->num_pairs = num_pairs, vnet->active_pairs = 1;
+    vnet->guest_clock = guest_clock, vnet->pcap = pcap;
+    vnet->rx_coal_default = vnet->rx_coal = rx_coal;
 }
 
 static int vnet_iovec_write(struct iovec **vecs,
@@ -116,12 +263,201 @@ static bool vnet_iovec_read(struct iovec **vecs,
     return n && !*nvecs;
 }
 
-static ssize_t handle_read(netdev_t *netdev,
+static inline uint16_t vnet_get16(const uint8_t *p)
+{
+    return (uint16_t) (p[0] << 8 | p[1]);
+}
+
+static inline void vnet_put16(uint8_t *p, uint16_t v)
+{
+    p[0] = v >> 8, p[1] = v;
+}
+
+static inline uint32_t vnet_get32(const uint8_t *p)
+{
+    return (uint32_t) vnet_get16(p) << 16 | vnet_get16(p + 2);
+}
+
+static inline void vnet_put32(uint8_t *p, uint32_t v)
+{
+    vnet_put16(p, v >> 16), vnet_put16(p + 2, v);
+}
+
+/* Accumulate the one's complement sum of 'n' bytes in network order */
+static uint32_t vnet_csum_add(uint32_t sum, const uint8_t *p, size_t n)
+{
+    for (; n > 1; p += 2, n -= 2)
+        sum += vnet_get16(p);
+    if (n)
+        sum += (uint32_t) p[0] << 8;
+    return sum;
+}
+
+static uint16_t vnet_csum_fold(uint32_t sum)
+{
+    while (sum >> 16)
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    return ~sum;
+}
+
+/* Hand one complete Ethernet frame to a backend that has no notion of the
+ * virtio-net header.
+ */
+static void vnet_peer_send(netdev_t *netdev, const uint8_t *frame, size_t len)
+{
+#define _(dev) NETDEV_IMPL_##dev
+    switch (netdev->type) {
+#if defined(__APPLE__)
+    case _(vmnet):
+        net_vmnet_write((net_vmnet_state_t *) netdev->op, frame, len);
+        break;
+#endif
+    case _(user): {
+        net_user_options_t *usr = (net_user_options_t *) netdev->op;
+        uint8_t *slot = slirp_ring_reserve(&usr->to_slirp);
+        if (!slot) {
+            /* The network thread is behind; drop the frame like a full
+             * NIC queue would and make sure it is draining.
+             */
+            net_slirp_kick(usr);
+            break;
+        }
+        if (len > SLIRP_SLOT_SIZE)
+            break;
+        memcpy(slot, frame, len);
+        slirp_ring_commit(&usr->to_slirp, len);
+        break;
+    }
+    case _(socket):
+        net_socket_send((net_socket_options_t *) netdev->op, frame, len);
+        break;
+    default:
+        break;
+    }
+#undef _
+}
+
+/* Split a TSO frame into MSS-sized segments, fixing up the IP length and ID,
+ * the TCP sequence number and flags, and both checksums of each segment.
+ * Segments are built in place: the header template is copied just in front
+ * of each payload chunk, over bytes that were already sent.
+ */
+static void vnet_tx_segment(netdev_t *netdev,
+                            uint8_t *frame,
+                            size_t len,
+                            const struct virtio_net_hdr *hdr)
+{
+    bool v4 = (hdr->gso_type & ~VIRTIO_NET_HDR_GSO_ECN) ==
+              VIRTIO_NET_HDR_GSO_TCPV4;
+    size_t l3 = 14;
+    if (len >= 18 && vnet_get16(frame + 12) == ETH_P_8021Q_)
+        l3 += 4;
+    size_t l4 = hdr->csum_start;
+    if (l4 < l3 + (v4 ? 20 : 40) || l4 + 20 > len)
+        return;
+    size_t hl = l4 + (frame[l4 + 12] >> 4) * 4;
+    size_t mss = hdr->gso_size;
+    if (hl < l4 + 20 || hl > len || hl > VNET_TX_HDRS_MAX || !mss)
+        return;
+
+    uint8_t tmpl[VNET_TX_HDRS_MAX];
+    memcpy(tmpl, frame, hl);
+    uint32_t seq = vnet_get32(tmpl + l4 + 4);
+    uint16_t ip_id = v4 ? vnet_get16(tmpl + l3 + 4) : 0;
+    uint8_t tcp_flags = tmpl[l4 + 13];
+
+    for (size_t off = hl, i = 0; off < len; off += mss, i++) {
+        size_t n = MIN(mss, len - off);
+        size_t l4_len = hl - l4 + n;
+        uint8_t *seg = frame + off - hl;
+        memcpy(seg, tmpl, hl);
+
+        uint32_t sum;
+        if (v4) {
+            vnet_put16(seg + l3 + 2, l4 - l3 + l4_len);
+            vnet_put16(seg + l3 + 4, ip_id + i);
+            vnet_put16(seg + l3 + 10, 0);
+            vnet_put16(seg + l3 + 10,
+                       vnet_csum_fold(vnet_csum_add(0, seg + l3, l4 - l3)));
+            sum = vnet_csum_add(0, seg + l3 + 12, 8);
+        } else {
+            vnet_put16(seg + l3 + 4, l4 - l3 - 40 + l4_len);
+            sum = vnet_csum_add(0, seg + l3 + 8, 32);
+        }
+
+        uint8_t flags = tcp_flags;
+        if (i)
+            flags &= ~TCP_FLAG_CWR;
+        if (off + n < len)
+            flags &= ~(TCP_FLAG_FIN | TCP_FLAG_PSH);
+        vnet_put32(seg + l4 + 4, seq + (off - hl));
+        seg[l4 + 13] = flags;
+        vnet_put16(seg + l4 + 16, 0);
+        sum += 6 /* IPPROTO_TCP */ + l4_len;
+        vnet_put16(seg + l4 + 16, vnet_csum_fold(vnet_csum_add(sum, seg + l4,
+                                                               l4_len)));
+        vnet_peer_send(netdev, seg, hl + n);
+    }
+}
+
+/* Backends without offload support need every frame finished in software:
+ * TSO frames are segmented, and a partial checksum left by the guest is
+ * completed over the range starting at csum_start.
+ */
+static ssize_t vnet_tx_offload(netdev_t *netdev,
+                               const struct virtio_net_hdr *hdr,
+                               struct iovec *iovs_cursor,
+                               size_t niovs)
+{
+    static uint8_t frame[VNET_TX_FRAME_MAX];
+    size_t len = 0;
+    for (size_t i = 0; i < niovs; i++)
+        len += iovs_cursor[i].iov_len;
+    if (len > sizeof(frame)) {
+        fprintf(stderr, "[VNET] dropping oversized frame (%zu bytes)\n", len);
+        return len;
+    }
+    vnet_iovec_read(&iovs_cursor, &niovs, frame, len);
+
+    if (hdr->gso_type != VIRTIO_NET_HDR_GSO_NONE) {
+        vnet_tx_segment(netdev, frame, len, hdr);
+        return len;
+    }
+
+    size_t start = hdr->csum_start, field = start + hdr->csum_offset;
+    if (field + 2 > len)
+        return len;
+    vnet_put16(frame + field,
+               vnet_csum_fold(vnet_csum_add(0, frame + start, len - start)));
+    vnet_peer_send(netdev, frame, len);
+    return len;
+}
+
+/* Receive one frame into the guest buffer, header included, and return the
+ * number of bytes written.
+ */
+static ssize_t handle_read(virtio_net_state_t *vnet,
                            virtio_net_queue_t *queue,
                            struct iovec *iovs_cursor,
                            size_t niovs)
 {
+    netdev_t *netdev = &vnet->peer;
+    uint32_t pair = VNET_QUEUE_PAIR(vnet, queue);
     ssize_t plen = 0;
+    struct virtio_net_hdr hdr = {.num_buffers = 1};
+
+#if !defined(__APPLE__)
+    if (netdev->type != NETDEV_IMPL_tap)
+#endif
+    {
+        /* slirp builds every frame with valid checksums */
+        if (netdev->type == NETDEV_IMPL_user &&
+            (vnet->DriverFeatures & VIRTIO_NET_F_GUEST_CSUM))
+            hdr.flags = VIRTIO_NET_HDR_F_DATA_VALID;
+        vnet_iovec_write(&iovs_cursor, &niovs, (const uint8_t *) &hdr,
+                         sizeof(hdr));
+    }
+
 #define _(dev) NETDEV_IMPL_##dev
     switch (netdev->type) {
 #if defined(__APPLE__)
@@ -152,7 +488,7 @@ static ssize_t handle_read(netdev_t *netdev,
 #else
     case _(tap): {
         net_tap_options_t *tap = (net_tap_options_t *) netdev->op;
-        plen = readv(tap->tap_fd, iovs_cursor, niovs);
+        plen = readv(tap->tap_fd[pair], iovs_cursor, niovs);
         if (plen < 0 && (errno == EWOULDBLOCK || errno == EAGAIN)) {
             queue->fd_ready = false;
             return -1;
@@ -161,41 +497,77 @@ static ssize_t handle_read(netdev_t *netdev,
             plen = 0;
             fprintf(stderr, "[VNET] could not read packet: %s\n",
                     strerror(errno));
+            break;
         }
-        break;
+
+        /* The kernel leaves num_buffers untouched */
+        uint8_t skip[offsetof(struct virtio_net_hdr, num_buffers)];
+        vnet_iovec_read(&iovs_cursor, &niovs, skip, sizeof(skip));
+        vnet_iovec_write(&iovs_cursor, &niovs,
+                         (const uint8_t *) &hdr.num_buffers,
+                         sizeof(hdr.num_buffers));
+        return plen;
     }
 #endif
     case _(user): {
         net_user_options_t *usr = (net_user_options_t *) netdev->op;
-
-        plen = readv(usr->guest_to_host_channel[SLIRP_READ_SIDE], iovs_cursor,
-                     niovs);
-        if (plen < 0 && (errno == EWOULDBLOCK || errno == EAGAIN)) {
+        slirp_ring_t *ring = &usr->to_guest[pair];
+        size_t len;
+        const uint8_t *frame = slirp_ring_peek(ring, &len);
+        if (!frame) {
             queue->fd_ready = false;
             return -1;
         }
-
-        if (plen < 0) {
-            plen = 0;
-            fprintf(stderr, "[VNET] could not read packet: %s\n",
-                    strerror(errno));
+        /* Like readv(), truncate frames that do not fit */
+        size_t room = 0;
+        for (size_t i = 0; i < niovs; i++)
+            room += iovs_cursor[i].iov_len;
+        plen = MIN(len, room);
+        vnet_iovec_write(&iovs_cursor, &niovs, frame, plen);
+        slirp_ring_release(ring);
+        break;
+    }
+    case _(socket): {
+        net_socket_options_t *sock = (net_socket_options_t *) netdev->op;
+        size_t len;
+        const uint8_t *frame = net_socket_peek(sock, &len);
+        if (!frame) {
+            queue->fd_ready = false;
+            return -1;
         }
-
+        size_t room = 0;
+        for (size_t i = 0; i < niovs; i++)
+            room += iovs_cursor[i].iov_len;
+        plen = MIN(len, room);
+        vnet_iovec_write(&iovs_cursor, &niovs, frame, plen);
+        net_socket_release(sock);
         break;
     }
     default:
         break;
     }
 #undef _
-    return plen;
+    return plen + sizeof(hdr);
 }
 
-static ssize_t handle_write(netdev_t *netdev,
+static ssize_t handle_write(virtio_net_state_t *vnet,
                             virtio_net_queue_t *queue,
+                            const struct virtio_net_hdr *hdr,
                             struct iovec *iovs_cursor,
                             size_t niovs)
 {
+    netdev_t *netdev = &vnet->peer;
     ssize_t plen = 0;
+
+#if !defined(__APPLE__)
+    if (netdev->type != NETDEV_IMPL_tap)
+#endif
+    {
+        if (hdr->gso_type != VIRTIO_NET_HDR_GSO_NONE ||
+            (hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM))
+            return vnet_tx_offload(netdev, hdr, iovs_cursor, niovs);
+    }
+
 #define _(dev) NETDEV_IMPL_##dev
     switch (netdev->type) {
 #if defined(__APPLE__)
@@ -214,7 +586,15 @@ static ssize_t handle_write(netdev_t *netdev,
 #else
     case _(tap): {
         net_tap_options_t *tap = (net_tap_options_t *) netdev->op;
-        plen = writev(tap->tap_fd, iovs_cursor, niovs);
+        /* Pass the guest's header through so the host kernel can finish
+         * checksums and segmentation.
+         */
+        struct iovec vecs[niovs + 1];
+        vecs[0].iov_base = (void *) hdr;
+        vecs[0].iov_len = sizeof(*hdr);
+        memcpy(vecs + 1, iovs_cursor, niovs * sizeof(*iovs_cursor));
+        plen = writev(tap->tap_fd[VNET_QUEUE_PAIR(vnet, queue)], vecs,
+                      niovs + 1);
         if (plen < 0 && (errno == EWOULDBLOCK || errno == EAGAIN)) {
             queue->fd_ready = false;
             return -1;
@@ -229,13 +609,34 @@ static ssize_t handle_write(netdev_t *netdev,
 #endif
     case _(user): {
         net_user_options_t *usr = (net_user_options_t *) netdev->op;
-        ssize_t written = writev(usr->host_to_guest_channel[SLIRP_WRITE_SIDE],
-                                 iovs_cursor, niovs);
-        if (written < 0) {
+        uint8_t *slot = slirp_ring_reserve(&usr->to_slirp);
+        if (!slot) {
             queue->fd_ready = false;
             return -1;
         }
-        plen = written;
+        size_t len = 0;
+        for (size_t i = 0; i < niovs; i++)
+            len += iovs_cursor[i].iov_len;
+        if (len > SLIRP_SLOT_SIZE) {
+            fprintf(stderr, "[VNET] dropping oversized frame (%zu bytes)\n",
+                    len);
+            return len;
+        }
+        vnet_iovec_read(&iovs_cursor, &niovs, slot, len);
+        slirp_ring_commit(&usr->to_slirp, len);
+        plen = len;
+        break;
+    }
+    case _(socket): {
+        net_socket_options_t *sock = (net_socket_options_t *) netdev->op;
+        size_t len = 0;
+        for (size_t i = 0; i < niovs; i++)
+            len += iovs_cursor[i].iov_len;
+        /* The switch has to look at the addresses, so gather the frame */
+        len = MIN(len, sizeof(sock->tx_frame));
+        vnet_iovec_read(&iovs_cursor, &niovs, sock->tx_frame, len);
+        net_socket_send(sock, sock->tx_frame, len);
+        plen = len;
         break;
     }
     default:
@@ -260,94 +661,461 @@ static ssize_t handle_write(netdev_t *netdev,
         desc_idx = desc->next;                                           \
     }
 
-/* Input: 'buffer_idx'.
- * Output: 'buffer_niovs' and 'buffer_iovs'
+/* Validate the available ring of 'queue'. Returns false when there is
+ * nothing to do, which includes having just failed the device.
  */
-#define VNET_BUFFER_TO_IOV(expect_readable)                                    \
-    uint16_t desc_idx;                                                         \
-    /* do a first pass to validate flags and count buffers */                  \
-    size_t buffer_niovs = 0;                                                   \
-    VNET_ITERATE_BUFFER(                                                       \
-        true, if ((!!(desc_flags & VIRTIO_DESC_F_WRITE)) !=                    \
-                  (expect_readable)) return virtio_net_set_fail(vnet);         \
-        buffer_niovs++;)                                                       \
-    /* convert to iov */                                                       \
-    struct iovec buffer_iovs[buffer_niovs];                                    \
-    buffer_niovs = 0;                                                          \
-    VNET_ITERATE_BUFFER(                                                       \
-        false, uint64_t desc_addr = desc->addr; uint32_t desc_len = desc->len; \
-        buffer_iovs[buffer_niovs].iov_base =                                   \
-            (void *) ((uintptr_t) ram + desc_addr);                            \
-        buffer_iovs[buffer_niovs].iov_len = desc_len; buffer_niovs++;)
-
-#define VNET_GENERATE_QUEUE_HANDLER(NAME_SUFFIX, VERB, QUEUE_IDX, READ)        \
-    static void virtio_net_try_##NAME_SUFFIX(virtio_net_state_t *vnet)         \
-    {                                                                          \
-        uint32_t *ram = vnet->ram;                                             \
-        virtio_net_queue_t *queue = &vnet->queues[QUEUE_IDX];                  \
-        if ((vnet->Status & VIRTIO_STATUS__DEVICE_NEEDS_RESET) ||              \
-            !queue->fd_ready)                                                  \
-            return;                                                            \
-        if (!((vnet->Status & VIRTIO_STATUS__DRIVER_OK) && queue->ready))      \
-            return virtio_net_set_fail(vnet);                                  \
-                                                                               \
-        /* check for new buffers */                                            \
-        uint16_t new_avail = ram[queue->QueueAvail] >> 16;                     \
-        if (new_avail - queue->last_avail > (uint16_t) queue->QueueNum)        \
-            return (fprintf(stderr, "size check fail\n"),                      \
-                    virtio_net_set_fail(vnet));                                \
-        if (queue->last_avail == new_avail)                                    \
-            return;                                                            \
-                                                                               \
-        /* process them */                                                     \
-        uint16_t new_used = ram[queue->QueueUsed] >> 16;                       \
-        while (queue->last_avail != new_avail) {                               \
-            uint16_t queue_idx = queue->last_avail % queue->QueueNum;          \
-            uint16_t buffer_idx =                                              \
-                ram[queue->QueueAvail + 1 + queue_idx / 2] >>                  \
-                (16 * (queue_idx % 2));                                        \
-            VNET_BUFFER_TO_IOV(READ)                                           \
-            struct iovec *buffer_iovs_cursor = buffer_iovs;                    \
-            uint8_t virtio_header[12];                                         \
-            if (READ) {                                                        \
-                memset(virtio_header, 0, sizeof(virtio_header));               \
-                virtio_header[10] = 1;                                         \
-                vnet_iovec_write(&buffer_iovs_cursor, &buffer_niovs,           \
-                                 virtio_header, sizeof(virtio_header));        \
-            } else {                                                           \
-                vnet_iovec_read(&buffer_iovs_cursor, &buffer_niovs,            \
-                                virtio_header, sizeof(virtio_header));         \
-            }                                                                  \
-                                                                               \
-            ssize_t plen = handle_##VERB(&vnet->peer, queue,                   \
-                                         buffer_iovs_cursor, buffer_niovs);    \
-            if (plen < 0)                                                      \
-                break;                                                         \
-            /* consume from available queue, write to used queue */            \
-            queue->last_avail++;                                               \
-            ram[queue->QueueUsed + 1 + (new_used % queue->QueueNum) * 2] =     \
-                buffer_idx;                                                    \
-            ram[queue->QueueUsed + 1 + (new_used % queue->QueueNum) * 2 + 1] = \
-                READ ? (plen + sizeof(virtio_header)) : 0;                     \
-            new_used++;                                                        \
-        }                                                                      \
-        vnet->ram[queue->QueueUsed] &= MASK(16);                               \
-        vnet->ram[queue->QueueUsed] |= ((uint32_t) new_used) << 16;            \
-                                                                               \
-        /* send interrupt, unless VIRTQ_AVAIL_F_NO_INTERRUPT is set */         \
-        if (!(ram[queue->QueueAvail] & 1))                                     \
-            vnet->InterruptStatus |= VIRTIO_INT__USED_RING;                    \
-    }
-
-VNET_GENERATE_QUEUE_HANDLER(rx, read, VNET_QUEUE_RX, true)
-VNET_GENERATE_QUEUE_HANDLER(tx, write, VNET_QUEUE_TX, false)
+static bool vnet_queue_pending(virtio_net_state_t *vnet,
+                               virtio_net_queue_t *queue,
+                               uint16_t *new_avail)
+{
+    uint32_t *ram = vnet->ram;
+    if ((vnet->Status & VIRTIO_STATUS__DEVICE_NEEDS_RESET) || !queue->fd_ready)
+        return false;
+    if (!((vnet->Status & VIRTIO_STATUS__DRIVER_OK) && queue->ready))
+        return virtio_net_set_fail(vnet), false;
+
+    /* check for new buffers */
+    *new_avail = ram[queue->QueueAvail] >> 16;
+    if ((uint16_t) (*new_avail - queue->last_avail) > queue->QueueNum)
+        return fprintf(stderr, "size check fail\n"), virtio_net_set_fail(vnet),
+               false;
+    return queue->last_avail != *new_avail;
+}
+
+static inline void vnet_used_push(virtio_net_state_t *vnet,
+                                  virtio_net_queue_t *queue,
+                                  uint16_t *new_used,
+                                  uint16_t buffer_idx,
+                                  uint32_t len)
+{
+    uint32_t *ram = vnet->ram;
+    uint16_t slot = *new_used % queue->QueueNum;
+    ram[queue->QueueUsed + 1 + slot * 2] = buffer_idx;
+    ram[queue->QueueUsed + 1 + slot * 2 + 1] = len;
+    (*new_used)++;
+}
+
+/* Guest time in microseconds, or 0 if the device has no clock */
+static uint64_t vnet_guest_usecs(const virtio_net_state_t *vnet)
+{
+    if (!vnet->guest_clock)
+        return 0;
+    uint64_t t = semu_timer_get(vnet->guest_clock);
+    uint64_t freq = vnet->guest_clock->freq;
+    return t / freq * 1000000 + t % freq * 1000000 / freq;
+}
+
+/* Coalescing parameters of a data queue; NULL for the control queue, or
+ * when there is no clock to time them.
+ */
+static const virtio_net_coal_t *vnet_queue_coal(
+    const virtio_net_state_t *vnet,
+    const virtio_net_queue_t *queue)
+{
+    uint32_t idx = queue - vnet->queues;
+    if (!vnet->guest_clock || idx == vnet_ctrl_queue(vnet))
+        return NULL;
+    return idx & 1 ? &vnet->tx_coal : &vnet->rx_coal;
+}
+
+static void vnet_interrupt(virtio_net_state_t *vnet, virtio_net_queue_t *queue)
+{
+    queue->coal_pending = 0;
+    /* send interrupt, unless VIRTQ_AVAIL_F_NO_INTERRUPT is set */
+    if (!(vnet->ram[queue->QueueAvail] & 1))
+        vnet->InterruptStatus |= VIRTIO_INT__USED_RING;
+}
+
+static void vnet_used_publish(virtio_net_state_t *vnet,
+                              virtio_net_queue_t *queue,
+                              uint16_t new_used)
+{
+    uint32_t *ram = vnet->ram;
+    uint16_t used = new_used - (ram[queue->QueueUsed] >> 16);
+    ram[queue->QueueUsed] &= MASK(16);
+    ram[queue->QueueUsed] |= ((uint32_t) new_used) << 16;
+    if (!used)
+        return;
+
+    /* Hold the interrupt back until enough buffers were used, or until the
+     * first of them has waited long enough; see vnet_coal_expire().
+     */
+    const virtio_net_coal_t *coal = vnet_queue_coal(vnet, queue);
+    if (coal && coal->usecs) {
+        if (!queue->coal_pending)
+            queue->coal_since = vnet_guest_usecs(vnet);
+        queue->coal_pending += used;
+        if (!coal->max_packets || queue->coal_pending < coal->max_packets)
+            return;
+    }
+    vnet_interrupt(vnet, queue);
+}
+
+/* Deliver the held-back interrupts whose time is up */
+static void vnet_coal_expire(virtio_net_state_t *vnet)
+{
+    uint64_t now = 0;
+    for (uint32_t i = 0; i < 2 * vnet->active_pairs; i++) {
+        virtio_net_queue_t *queue = &vnet->queues[i];
+        if (!queue->coal_pending)
+            continue;
+        if (!now)
+            now = vnet_guest_usecs(vnet);
+        const virtio_net_coal_t *coal = vnet_queue_coal(vnet, queue);
+        if (!coal || now - queue->coal_since >= coal->usecs)
+            vnet_interrupt(vnet, queue);
+    }
+}
+
+bool virtio_net_coal_pending(const virtio_net_state_t *vnet)
+{
+    for (uint32_t i = 0; i < 2 * vnet->active_pairs; i++) {
+        if (vnet->queues[i].coal_pending)
+            return true;
+    }
+    return false;
+}
+
+/* Largest frame, header included, the peer may deliver to the guest */
+static size_t vnet_rx_frame_max(const virtio_net_state_t *vnet)
+{
+    if (vnet->DriverFeatures &
+        (VIRTIO_NET_F_GUEST_TSO4 | VIRTIO_NET_F_GUEST_TSO6))
+        return sizeof(struct virtio_net_hdr) + VNET_TX_FRAME_MAX;
+    return sizeof(struct virtio_net_hdr) + 1518;
+}
+
+/* Room the next received frame of 'pair' needs, header included. The user
+ * and socket backends queue whole frames and know their length up front;
+ * for the others it is only known after the read, so assume the largest.
+ */
+static size_t vnet_rx_frame_need(virtio_net_state_t *vnet, uint32_t pair)
+{
+    netdev_t *netdev = &vnet->peer;
+    const uint8_t *frame = NULL;
+    size_t len = 0;
+
+    switch (netdev->type) {
+    case NETDEV_IMPL_user:
+        frame = slirp_ring_peek(
+            &((net_user_options_t *) netdev->op)->to_guest[pair], &len);
+        break;
+    case NETDEV_IMPL_socket:
+        frame = net_socket_peek((net_socket_options_t *) netdev->op, &len);
+        break;
+    default:
+        return vnet_rx_frame_max(vnet);
+    }
+    /* Nothing queued: handle_read() will find that out on one buffer */
+    return sizeof(struct virtio_net_hdr) + (frame ? len : 0);
+}
+
+static inline uint16_t vnet_avail_buffer(const virtio_net_state_t *vnet,
+                                         const virtio_net_queue_t *queue,
+                                         uint16_t avail)
+{
+    uint16_t queue_idx = avail % queue->QueueNum;
+    return vnet->ram[queue->QueueAvail + 1 + queue_idx / 2] >>
+           (16 * (queue_idx % 2));
+}
+
+/* Append the descriptor chain starting at 'buffer_idx' to 'iovs', which has
+ * room for 'max' more entries. Returns 1 on success, 0 if the chain does not
+ * fit, or -1 after failing the device on a malformed chain. A chain that does
+ * not fit is well-formed: callers skip or retry it, the device keeps running.
+ */
+static int vnet_chain_to_iov(virtio_net_state_t *vnet,
+                             virtio_net_queue_t *queue,
+                             uint16_t buffer_idx,
+                             bool writable,
+                             struct iovec *iovs,
+                             size_t max,
+                             size_t *niovs,
+                             uint32_t *len)
+{
+    uint32_t *ram = vnet->ram;
+    uint16_t desc_idx = buffer_idx;
+    *niovs = 0, *len = 0;
+    while (1) {
+        if (desc_idx >= queue->QueueNum)
+            return virtio_net_set_fail(vnet), -1;
+        if (*niovs == max)
+            return 0;
+        const struct virtq_desc *desc =
+            (struct virtq_desc *) &ram[queue->QueueDesc + desc_idx * 4];
+        if (!(desc->flags & VIRTIO_DESC_F_WRITE) != !writable ||
+            desc->addr >= RAM_SIZE || desc->len > RAM_SIZE - desc->addr)
+            return virtio_net_set_fail(vnet), -1;
+        iovs[*niovs].iov_base = (void *) ((uintptr_t) ram + desc->addr);
+        iovs[*niovs].iov_len = desc->len;
+        (*niovs)++;
+        *len += desc->len;
+        if (!(desc->flags & VIRTIO_DESC_F_NEXT))
+            return 1;
+        desc_idx = desc->next;
+    }
+}
+
+/* Collect writable guest buffers starting at 'last_avail' into 'iovs'. With
+ * VIRTIO_NET_F_MRG_RXBUF, several buffers are gathered until they can hold
+ * 'need' bytes, or until the next one would overflow 'iovs'.
+ * A buffer whose chain alone overflows 'iovs' is returned to the guest empty.
+ * Returns the number of buffers collected, 0 if the guest has not posted
+ * enough yet, or -1 after failing the device.
+ */
+static int vnet_rx_gather(virtio_net_state_t *vnet,
+                          virtio_net_queue_t *queue,
+                          uint16_t new_avail,
+                          uint16_t *new_used,
+                          size_t need,
+                          struct iovec *iovs,
+                          size_t *niovs,
+                          uint16_t *heads,
+                          uint32_t *lens)
+{
+    bool mrg = vnet->DriverFeatures & VIRTIO_NET_F_MRG_RXBUF;
+    size_t total = 0;
+    uint16_t avail = queue->last_avail;
+    int nbufs = 0;
+
+    *niovs = 0;
+    while (1) {
+        uint16_t buffer_idx = vnet_avail_buffer(vnet, queue, avail);
+        size_t n;
+        uint32_t len;
+        int ret = vnet_chain_to_iov(vnet, queue, buffer_idx, true,
+                                    iovs + *niovs, VNET_RX_IOV_MAX - *niovs,
+                                    &n, &len);
+        if (ret < 0)
+            return -1;
+        if (!ret) {
+            /* The frame makes do with the buffers gathered so far */
+            if (nbufs)
+                return nbufs;
+            vnet_used_push(vnet, queue, new_used, buffer_idx, 0);
+            queue->last_avail = ++avail;
+            if (avail == new_avail)
+                return 0;
+            continue;
+        }
+        avail++;
+        *niovs += n;
+        heads[nbufs] = buffer_idx;
+        lens[nbufs++] = len;
+        total += len;
+        if (!mrg || total >= need || nbufs == VNET_RX_BUFS_MAX)
+            return nbufs;
+        if (avail == new_avail)
+            return 0;
+    }
+}
+
+/* Tee one frame into the packet capture. The frame starts 'skip' bytes into
+ * the iovec, which is left untouched.
+ */
+static void vnet_capture(virtio_net_state_t *vnet,
+                         const struct iovec *iovs,
+                         size_t niovs,
+                         size_t skip,
+                         size_t len,
+                         bool tx)
+{
+    uint64_t guest_ns = 0;
+    if (vnet->guest_clock) {
+        uint64_t t = semu_timer_get(vnet->guest_clock);
+        uint64_t freq = vnet->guest_clock->freq;
+        guest_ns = t / freq * 1000000000 + t % freq * 1000000000 / freq;
+    }
+    net_pcap_capture(vnet->pcap, iovs, niovs, skip, len, tx, guest_ns);
+}
+
+/* Fill as many guest buffers as the peer has frames for, then publish the
+ * used ring and raise the interrupt once for the whole pass.
+ */
+static void virtio_net_try_rx(virtio_net_state_t *vnet, uint32_t pair)
+{
+    virtio_net_queue_t *queue = &vnet->queues[VNET_QUEUE_RX(pair)];
+    uint16_t new_avail;
+    if (!vnet_queue_pending(vnet, queue, &new_avail))
+        return;
+
+    uint16_t new_used = vnet->ram[queue->QueueUsed] >> 16;
+    while (queue->last_avail != new_avail && queue->fd_ready) {
+        struct iovec iovs[VNET_RX_IOV_MAX];
+        uint16_t heads[VNET_RX_BUFS_MAX];
+        uint32_t lens[VNET_RX_BUFS_MAX];
+        size_t niovs;
+        int nbufs = vnet_rx_gather(vnet, queue, new_avail, &new_used,
+                                   vnet_rx_frame_need(vnet, pair), iovs,
+                                   &niovs, heads, lens);
+        if (nbufs < 0)
+            return;
+        if (!nbufs)
+            break;
+
+        /* The header may straddle descriptors; locate num_buffers first,
+         * since handle_read() consumes the iovec.
+         */
+        uint8_t *num_buffers[2] = {NULL, NULL};
+        size_t off = offsetof(struct virtio_net_hdr, num_buffers);
+        for (size_t i = 0, j = 0; i < niovs && j < 2; i++) {
+            for (; off < iovs[i].iov_len && j < 2; off++)
+                num_buffers[j++] = (uint8_t *) iovs[i].iov_base + off;
+            off -= iovs[i].iov_len;
+        }
+
+        /* handle_read() consumes the iovec, so keep a copy to capture */
+        struct iovec saved[VNET_RX_IOV_MAX];
+        if (vnet->pcap)
+            memcpy(saved, iovs, niovs * sizeof(*iovs));
+
+        ssize_t plen = handle_read(vnet, queue, iovs, niovs);
+        if (plen < 0)
+            break;
+        if (vnet->pcap)
+            vnet_capture(vnet, saved, niovs, sizeof(struct virtio_net_hdr),
+                         plen - sizeof(struct virtio_net_hdr), false);
+
+        /* consume from available queue, write to used queue */
+        size_t left = plen;
+        uint16_t used = 0;
+        do {
+            uint32_t len = MIN(left, lens[used]);
+            vnet_used_push(vnet, queue, &new_used, heads[used++], len);
+            left -= len;
+        } while (left && used < nbufs);
+        queue->last_avail += used;
+        if (num_buffers[1])
+            num_buffers[0][0] = used, num_buffers[1][0] = used >> 8;
+    }
+    vnet_used_publish(vnet, queue, new_used);
+}
+
+static void virtio_net_try_tx(virtio_net_state_t *vnet, uint32_t pair)
+{
+    virtio_net_queue_t *queue = &vnet->queues[VNET_QUEUE_TX(pair)];
+    uint16_t new_avail;
+    if (!vnet_queue_pending(vnet, queue, &new_avail))
+        return;
+
+    uint16_t new_used = vnet->ram[queue->QueueUsed] >> 16;
+    while (queue->last_avail != new_avail && queue->fd_ready) {
+        uint16_t buffer_idx =
+            vnet_avail_buffer(vnet, queue, queue->last_avail);
+        struct iovec iovs[VNET_RX_IOV_MAX], *cursor = iovs;
+        size_t niovs;
+        uint32_t len;
+        int ret = vnet_chain_to_iov(vnet, queue, buffer_idx, false, iovs,
+                                    VNET_RX_IOV_MAX, &niovs, &len);
+        if (ret < 0)
+            return;
+        if (!ret) {
+            /* Too many segments to send in one go: drop the frame */
+            queue->last_avail++;
+            vnet_used_push(vnet, queue, &new_used, buffer_idx, 0);
+            continue;
+        }
+        struct virtio_net_hdr hdr = {0};
+        if (vnet_iovec_read(&cursor, &niovs, (uint8_t *) &hdr, sizeof(hdr))) {
+            /* No complete header: nothing sane to transmit */
+            queue->last_avail++;
+            vnet_used_push(vnet, queue, &new_used, buffer_idx, 0);
+            continue;
+        }
+        struct iovec saved[VNET_RX_IOV_MAX];
+        if (vnet->pcap)
+            memcpy(saved, cursor, niovs * sizeof(*cursor));
+        ssize_t plen = handle_write(vnet, queue, &hdr, cursor, niovs);
+        if (plen < 0)
+            break;
+        if (vnet->pcap && len > sizeof(hdr))
+            vnet_capture(vnet, saved, niovs, 0, len - sizeof(hdr), true);
+        /* consume from available queue, write to used queue */
+        queue->last_avail++;
+        vnet_used_push(vnet, queue, &new_used, buffer_idx, 0);
+    }
+    vnet_used_publish(vnet, queue, new_used);
+
+    if (vnet->peer.type == NETDEV_IMPL_user)
+        net_slirp_kick((net_user_options_t *) vnet->peer.op);
+}
+
+/* Serve control queue commands. Only the multiqueue class is offered; any
+ * other command is acknowledged with VIRTIO_NET_ERR.
+ */
+static void virtio_net_try_ctrl(virtio_net_state_t *vnet)
+{
+    uint32_t *ram = vnet->ram;
+    virtio_net_queue_t *queue = &vnet->queues[vnet_ctrl_queue(vnet)];
+    uint16_t new_avail;
+    /* commands are handled synchronously, never waiting on the peer */
+    queue->fd_ready = true;
+    if (!vnet_queue_pending(vnet, queue, &new_avail))
+        return;
+
+    uint16_t new_used = ram[queue->QueueUsed] >> 16;
+    while (queue->last_avail != new_avail) {
+        uint16_t queue_idx = queue->last_avail % queue->QueueNum;
+        uint16_t buffer_idx = ram[queue->QueueAvail + 1 + queue_idx / 2] >>
+                              (16 * (queue_idx % 2));
+        uint8_t cmd[16] = {0}, *ack = NULL;
+        size_t cmd_len = 0;
+        uint16_t desc_idx;
+        VNET_ITERATE_BUFFER(
+            true, uint8_t *buf = (uint8_t *) ram + desc->addr;
+            if (desc_flags & VIRTIO_DESC_F_WRITE) {
+                if (!ack && desc->len)
+                    ack = buf;
+            } else {
+                size_t n = MIN(desc->len, sizeof(cmd) - cmd_len);
+                memcpy(cmd + cmd_len, buf, n);
+                cmd_len += n;
+            })
+        if (!ack)
+            return virtio_net_set_fail(vnet);
+
+        uint8_t status = VIRTIO_NET_ERR;
+        uint16_t pairs = cmd[2] | cmd[3] << 8;
+        if (cmd_len >= 4 && cmd[0] == VIRTIO_NET_CTRL_MQ &&
+            cmd[1] == VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET && pairs >= 1 &&
+            pairs <= vnet->num_pairs) {
+            vnet->active_pairs = pairs;
+            netdev_set_queues(&vnet->peer, pairs);
+            status = VIRTIO_NET_OK;
+        } else if (cmd_len >= 10 && cmd[0] == VIRTIO_NET_CTRL_NOTF_COAL &&
+                   (vnet->DriverFeatures1 & VIRTIO_NET_F_NOTF_COAL) &&
+                   (cmd[1] == VIRTIO_NET_CTRL_NOTF_COAL_TX_SET ||
+                    cmd[1] == VIRTIO_NET_CTRL_NOTF_COAL_RX_SET)) {
+            /* struct virtio_net_ctrl_coal: le32 max_packets, le32 usecs */
+            virtio_net_coal_t *coal = cmd[1] == VIRTIO_NET_CTRL_NOTF_COAL_RX_SET
+                                          ? &vnet->rx_coal
+                                          : &vnet->tx_coal;
+            memcpy(&coal->max_packets, cmd + 2, 4);
+            memcpy(&coal->usecs, cmd + 6, 4);
+            status = VIRTIO_NET_OK;
+        }
+        *ack = status;
+
+        queue->last_avail++;
+        vnet_used_push(vnet, queue, &new_used, buffer_idx, 1);
+    }
+    vnet_used_publish(vnet, queue, new_used);
+}
 
 void virtio_net_refresh_queue(virtio_net_state_t *vnet)
 {
+    /* Consume the slirp thread's notification even if the driver is not
+     * ready yet, so that its wake fd does not stay readable.
+     */
+    if (vnet->peer.op && vnet->peer.type == NETDEV_IMPL_user)
+        net_slirp_rx_ack((net_user_options_t *) vnet->peer.op);
+
     if (!(vnet->Status & VIRTIO_STATUS__DRIVER_OK) ||
         (vnet->Status & VIRTIO_STATUS__DEVICE_NEEDS_RESET))
         return;
 
+    vnet_coal_expire(vnet);
+
     /* Skip if peer network device is not initialized */
     if (!vnet->peer.op)
         return;
@@ -362,47 +1130,68 @@ void virtio_net_refresh_queue(virtio_net_state_t *vnet)
         struct pollfd pfd = {fd, POLLIN, 0};
         poll(&pfd, 1, 0);
         if (pfd.revents & POLLIN) {
-            vnet->queues[VNET_QUEUE_RX].fd_ready = true;
-            virtio_net_try_rx(vnet);
+            vnet->queues[VNET_QUEUE_RX(0)].fd_ready = true;
+            virtio_net_try_rx(vnet, 0);
         }
         /* vmnet writes asynchronously; treat TX queue as always ready */
-        vnet->queues[VNET_QUEUE_TX].fd_ready = true;
-        virtio_net_try_tx(vnet);
+        vnet->queues[VNET_QUEUE_TX(0)].fd_ready = true;
+        virtio_net_try_tx(vnet, 0);
         break;
     }
 #else
     case _(tap): {
         net_tap_options_t *tap = (net_tap_options_t *) vnet->peer.op;
-        struct pollfd pfd = {tap->tap_fd, POLLIN | POLLOUT, 0};
-        poll(&pfd, 1, 0);
-        if (pfd.revents & POLLIN) {
-            vnet->queues[VNET_QUEUE_RX].fd_ready = true;
-            virtio_net_try_rx(vnet);
-        }
-        if (pfd.revents & POLLOUT) {
-            vnet->queues[VNET_QUEUE_TX].fd_ready = true;
-            virtio_net_try_tx(vnet);
+        uint32_t n = vnet->active_pairs;
+        struct pollfd pfd[VNET_PAIRS_MAX];
+        for (uint32_t i = 0; i < n; i++)
+            pfd[i] = (struct pollfd){tap->tap_fd[i], POLLIN | POLLOUT, 0};
+        poll(pfd, n, 0);
+        for (uint32_t i = 0; i < n; i++) {
+            if (pfd[i].revents & POLLIN) {
+                vnet->queues[VNET_QUEUE_RX(i)].fd_ready = true;
+                virtio_net_try_rx(vnet, i);
+            }
+            if (pfd[i].revents & POLLOUT) {
+                vnet->queues[VNET_QUEUE_TX(i)].fd_ready = true;
+                virtio_net_try_tx(vnet, i);
+            }
         }
         break;
     }
+    case _(vhost_user):
+        /* The back-end moves the frames and only asks for the interrupt */
+        if (net_vhost_user_ack((net_vhost_user_options_t *) vnet->peer.op))
+            vnet->InterruptStatus |= VIRTIO_INT__USED_RING;
+        break;
 #endif
     case _(user): {
+        /* Both rings live in memory: TX is ready whenever the guest has
+         * posted a frame, and RX whenever the slirp thread has queued one.
+         */
         net_user_options_t *usr = (net_user_options_t *) vnet->peer.op;
-        struct pollfd pfd[3] = {
-            {usr->guest_to_host_channel[SLIRP_READ_SIDE], POLLIN, 0},
-            {usr->host_to_guest_channel[SLIRP_READ_SIDE], POLLIN, 0},
-            {usr->host_to_guest_channel[SLIRP_WRITE_SIDE], POLLOUT, 0}};
-        poll(pfd, 3, 0);
-        if (pfd[0].revents & POLLIN) {
-            vnet->queues[VNET_QUEUE_RX].fd_ready = true;
-            virtio_net_try_rx(vnet);
+        for (uint32_t i = 0; i < vnet->active_pairs; i++) {
+            vnet->queues[VNET_QUEUE_TX(i)].fd_ready = true;
+            virtio_net_try_tx(vnet, i);
         }
-        if (pfd[1].revents & POLLIN) {
-            net_slirp_read(usr);
+        for (uint32_t i = 0; i < vnet->active_pairs; i++) {
+            if (!slirp_ring_empty(&usr->to_guest[i])) {
+                vnet->queues[VNET_QUEUE_RX(i)].fd_ready = true;
+                virtio_net_try_rx(vnet, i);
+            }
         }
-        if (pfd[2].revents & POLLOUT) {
-            vnet->queues[VNET_QUEUE_TX].fd_ready = true;
-            virtio_net_try_tx(vnet);
+        break;
+    }
+    case _(socket): {
+        /* Datagrams are sent without blocking, so TX is always ready.
+         * Peeking also runs the switch when this guest hosts it.
+         */
+        net_socket_options_t *sock = (net_socket_options_t *) vnet->peer.op;
+        vnet->queues[VNET_QUEUE_TX(0)].fd_ready = true;
+        virtio_net_try_tx(vnet, 0);
+        size_t len;
+        if (net_socket_peek(sock, &len)) {
+            vnet->queues[VNET_QUEUE_RX(0)].fd_ready = true;
+            virtio_net_try_rx(vnet, 0);
         }
         break;
     }
@@ -412,12 +1201,32 @@ void virtio_net_refresh_queue(virtio_net_state_t *vnet)
 #undef _
 }
 
-void virtio_net_recv_from_peer(void *peer)
+int virtio_net_wake_fd(const virtio_net_state_t *vnet)
 {
-    virtio_net_state_t *vnet = (virtio_net_state_t *) peer;
-    vnet->queues[VNET_QUEUE_RX].fd_ready = true;
+    if (!vnet->peer.op)
+        return -1;
 
-    virtio_net_try_rx(vnet);
+    switch (vnet->peer.type) {
+    case NETDEV_IMPL_user:
+        return net_slirp_notify_fd((net_user_options_t *) vnet->peer.op);
+    case NETDEV_IMPL_socket: {
+        /* Only while nothing is held for the guest, or a readable socket
+         * would keep waking the loop until the guest posts a buffer.
+         */
+        net_socket_options_t *sock = (net_socket_options_t *) vnet->peer.op;
+        if (!(vnet->Status & VIRTIO_STATUS__DRIVER_OK) || sock->rx_len)
+            return -1;
+        return sock->fd;
+    }
+#if !defined(__APPLE__)
+    case NETDEV_IMPL_vhost_user: {
+        net_vhost_user_options_t *vu = vnet_vhost_user(vnet);
+        return vu->started ? vu->call_fd : -1;
+    }
+#endif
+    default:
+        return -1;
+    }
 }
 
 static bool virtio_net_reg_read(virtio_net_state_t *vnet,
@@ -441,12 +1250,15 @@ static bool virtio_net_reg_read(virtio_net_state_t *vnet,
 
     case _(DeviceFeatures):
         *value = vnet->DeviceFeaturesSel == 0
-                     ? VNET_FEATURES_0
-                     : (vnet->DeviceFeaturesSel == 1 ? VNET_FEATURES_1 : 0);
+                     ? vnet_features_0(vnet)
+                     : (vnet->DeviceFeaturesSel == 1 ? vnet_features_1(vnet)
+                                                     : 0);
         return true;
 
     case _(QueueNumMax):
-        *value = VNET_QUEUE_NUM_MAX;
+        /* Queues past the control queue do not exist */
+        *value = vnet->QueueSel <= vnet_ctrl_queue(vnet) ? VNET_QUEUE_NUM_MAX
+                                                          : 0;
         return true;
     case _(QueueReady):
         *value = VNET_QUEUE.ready ? 1 : 0;
@@ -489,7 +1301,10 @@ static bool virtio_net_reg_write(virtio_net_state_t *vnet,
         vnet->DeviceFeaturesSel = value;
         return true;
     case _(DriverFeatures):
-        vnet->DriverFeaturesSel == 0 ? (vnet->DriverFeatures = value) : 0;
+        if (vnet->DriverFeaturesSel == 0)
+            vnet->DriverFeatures = value;
+        else if (vnet->DriverFeaturesSel == 1)
+            vnet->DriverFeatures1 = value;
         return true;
     case _(DriverFeaturesSel):
         vnet->DriverFeaturesSel = value;
@@ -511,7 +1326,7 @@ static bool virtio_net_reg_write(virtio_net_state_t *vnet,
         VNET_QUEUE.ready = value & 1;
         if (value & 1)
             VNET_QUEUE.last_avail = vnet->ram[VNET_QUEUE.QueueAvail] >> 16;
-        if (vnet->QueueSel == VNET_QUEUE_RX)
+        if (!(vnet->QueueSel & 1) && vnet->QueueSel != vnet_ctrl_queue(vnet))
             vnet->ram[VNET_QUEUE.QueueAvail] |=
                 1; /* set VIRTQ_AVAIL_F_NO_INTERRUPT */
         return true;
@@ -539,14 +1354,18 @@ static bool virtio_net_reg_write(virtio_net_state_t *vnet,
 
     case _(QueueNotify):
         if (value < ARRAY_SIZE(vnet->queues)) {
-            switch (value) {
-            case VNET_QUEUE_RX:
-                virtio_net_try_rx(vnet);
-                break;
-            case VNET_QUEUE_TX:
-                virtio_net_try_tx(vnet);
-                break;
-            }
+            if (value == vnet_ctrl_queue(vnet))
+                virtio_net_try_ctrl(vnet);
+            else if (value / 2 >= vnet->num_pairs)
+                virtio_net_set_fail(vnet);
+#if !defined(__APPLE__)
+            else if (vnet_vhost_user(vnet))
+                net_vhost_user_kick(vnet_vhost_user(vnet), value);
+#endif
+            else if (value & 1)
+                virtio_net_try_tx(vnet, value / 2);
+            else
+                virtio_net_try_rx(vnet, value / 2);
         } else {
             virtio_net_set_fail(vnet);
         }
@@ -618,7 +1437,78 @@ void virtio_net_write(hart_t *vm,
     }
 }
 
-bool virtio_net_init(virtio_net_state_t *vnet, const char *name)
+typedef struct {
+    char *backend;
+    uint32_t queues;
+    char *path;
+    char *pcap;
+    uint64_t pcap_limit;
+    virtio_net_coal_t rx_coal;
+} vnet_options_t;
+
+/* Parse an option value in [0, UINT32_MAX] */
+static uint32_t virtio_net_parse_u32(const char *name, const char *value)
+{
+    char *end;
+    errno = 0;
+    unsigned long long n = strtoull(value, &end, 10);
+    if (errno || end == value || *end || n > UINT32_MAX) {
+        fprintf(stderr, "virtio-net: %s expects an integer, got '%s'\n", name,
+                value);
+        exit(2);
+    }
+    return n;
+}
+
+/* Parse "BACKEND[,queues=N][,path=PATH][,pcap=FILE[,pcap-limit=MIB]]
+ * [,rx-usecs=N][,rx-frames=N]"
+ */
+static void virtio_net_parse_options(char *spec, vnet_options_t *opts)
+{
+    opts->backend = strtok(spec, ",");
+    for (char *opt; (opt = strtok(NULL, ","));) {
+        if (!strncmp(opt, "queues=", 7)) {
+            char *end;
+            errno = 0;
+            unsigned long n = strtoul(opt + 7, &end, 10);
+            if (errno || end == opt + 7 || *end || n < 1 ||
+                n > VNET_PAIRS_MAX) {
+                fprintf(stderr,
+                        "virtio-net: queues= expects an integer in [1,%d], "
+                        "got '%s'\n",
+                        VNET_PAIRS_MAX, opt + 7);
+                exit(2);
+            }
+            opts->queues = n;
+        } else if (!strncmp(opt, "path=", 5) && opt[5]) {
+            opts->path = opt + 5;
+        } else if (!strncmp(opt, "pcap=", 5) && opt[5]) {
+            opts->pcap = opt + 5;
+        } else if (!strncmp(opt, "pcap-limit=", 11)) {
+            char *end;
+            errno = 0;
+            unsigned long long n = strtoull(opt + 11, &end, 10);
+            if (errno || end == opt + 11 || *end || !n || n > (1ULL << 32)) {
+                fprintf(stderr,
+                        "virtio-net: pcap-limit= expects a size in MiB, "
+                        "got '%s'\n",
+                        opt + 11);
+                exit(2);
+            }
+            opts->pcap_limit = n << 20;
+        } else if (!strncmp(opt, "rx-usecs=", 9)) {
+            opts->rx_coal.usecs = virtio_net_parse_u32("rx-usecs=", opt + 9);
+        } else if (!strncmp(opt, "rx-frames=", 10)) {
+            opts->rx_coal.max_packets =
+                virtio_net_parse_u32("rx-frames=", opt + 10);
+        } else {
+            fprintf(stderr, "unknown virtio-net option '%s'\n", opt);
+            exit(2);
+        }
+    }
+}
+
+bool virtio_net_init(virtio_net_state_t *vnet, char *spec, uint32_t num_pairs)
 {
     if (vnet_dev_cnt >= VNET_DEV_CNT_MAX) {
         fprintf(stderr,
@@ -629,14 +1519,40 @@ bool virtio_net_init(virtio_net_state_t *vnet, const char *name)
     /* Allocate memory for the private member */
     vnet->priv = &vnet_configs[vnet_dev_cnt++];
 
-    if (!netdev_init(&vnet->peer, name)) {
+    /* One queue pair per hart unless given explicitly */
+    vnet_options_t opts = {.queues = MIN(num_pairs, VNET_PAIRS_MAX)};
+    virtio_net_parse_options(spec, &opts);
+    const char *name = opts.backend;
+
+    vnet->peer.name = opts.path;
+    if (!netdev_init(&vnet->peer, name, opts.queues)) {
         fprintf(stderr, "Fail to init net device %s\n", name);
         return false;
     }
 
+#if !defined(__APPLE__)
+    if (vnet_vhost_user(vnet) && (opts.pcap || opts.rx_coal.usecs))
+        fprintf(stderr, "virtio-net: frames bypass semu with vhost-user; "
+                        "pcap= and rx-usecs= have no effect\n");
+#endif
+    if (opts.pcap) {
+        vnet->pcap = net_pcap_open(opts.pcap, opts.pcap_limit);
+        if (!vnet->pcap)
+            return false;
+    }
+
+    /* Applies until the driver sets its own, and again after each reset */
+    vnet->rx_coal_default = vnet->rx_coal = opts.rx_coal;
+
+    /* The backend may serve fewer queues than requested */
+    vnet->num_pairs = vnet->peer.queues;
+    vnet->active_pairs = 1;
+    PRIV(vnet)->max_virtqueue_pairs = vnet->num_pairs;
+    netdev_set_queues(&vnet->peer, 1);
+
 #if defined(__APPLE__)
     if (vnet->peer.type == NETDEV_IMPL_vmnet)
-        vnet->queues[VNET_QUEUE_TX].fd_ready = true;
+        vnet->queues[VNET_QUEUE_TX(0)].fd_ready = true;
 #endif
 
     return true;